@@ -0,0 +1,49 @@
+#ifndef _H_EVENTQUEUE
+#define _H_EVENTQUEUE
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Synth {
+    
+    const static size_t CACHE_LINE = 64;
+    
+    struct LiveEvent {
+        public:
+            uint64_t time; // Sample to apply it on; one already past applies at the next block
+            uint16_t msgType;
+            uint8_t data[2];
+    };
+    
+    /*
+     * Lock-free ring of live events for one producer thread and one consumer,
+     * the render loop. Neither side ever blocks or allocates once built.
+     */
+    class EventQueue {
+        private:
+            std::vector<LiveEvent> ring;
+            size_t mask;
+            alignas(CACHE_LINE) std::atomic<size_t> head; // Next to pop, owned by the consumer
+            alignas(CACHE_LINE) std::atomic<size_t> tail; // Next to push, owned by the producer
+        public:
+            EventQueue(size_t capacity = 1024); // Rounded up to a power of two
+            EventQueue(const EventQueue&) = delete;
+            EventQueue& operator=(const EventQueue&) = delete;
+            
+            // Producer side; false if the queue is full
+            bool push(const LiveEvent& event);
+            
+            // Consumer side; front is null while the queue is empty
+            const LiveEvent *front() const;
+            void pop();
+            inline size_t capacity() const
+            {
+                return ring.size();
+            }
+    };
+    
+}
+
+#endif
\ No newline at end of file
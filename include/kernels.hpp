@@ -0,0 +1,52 @@
+#ifndef _H_KERNELS
+#define _H_KERNELS
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Block kernels for the oscillator shapes.
+ *
+ * Each kernel evaluates one of the Synth resfuncs over whole arrays of
+ * per-sample phases and wave params. The AVX2 and SSE2 paths use a range
+ * reduced polynomial sine that stays within 1e-6 of std::sin for the phases
+ * a voice produces, so their output matches the scalar resfuncs to about
+ * 2e-6 of full scale. The one exception is the reset of the saw shapes: a
+ * phase within an ulp of the discontinuity may land on either side of it.
+ * The scalar path calls the resfuncs themselves and is exact. Every sample
+ * takes the same path whatever the array length, so a voice renders
+ * identically however its samples are split into calls.
+ */
+
+namespace Synth {
+
+    namespace Kernels {
+
+        enum Isa {
+            SCALAR = 0,
+            SSE2 = 1,
+            AVX2 = 2
+        };
+
+        Isa isa();
+        Isa setIsa(Isa isa); // Clamped to what the CPU supports; not thread safe
+
+        void sinSaw(const float *phase, const float *param, float *out, size_t count);
+        void resonantSaw(const float *phase, const float *param, float *out, size_t count);
+        // Noise in [0, 1] at sample counter of the stream seed picks. Counter based, so a sample
+        // draws the same alone or in a block, on any ISA, and streams need no shared state.
+        float noiseAt(uint32_t seed, uint64_t counter);
+        // The noise shape from sample counter of its stream on, each sample filtering the last
+        void noise(const float *param, const float *amplitude, uint32_t seed, uint64_t counter,
+            float& previous, float *out, size_t count);
+
+        void multiply(float *dst, const float *src, size_t count); // dst *= src
+        void accumulate(float *dst, const float *src, float scale, size_t count); // dst += src * scale
+        // dst = src * scale, clamped to +-scale and truncated to integer PCM
+        void toPcm(int32_t *dst, const float *src, float scale, size_t count);
+
+    }
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,37 @@
+#ifndef _H_MAPPEDFILE
+#define _H_MAPPEDFILE
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace Synth {
+    
+    // Read-only view of a whole file through the page cache
+    class MappedFile {
+        private:
+            const uint8_t *bytes;
+            size_t length;
+            void *handle; // Mapping object on Windows, unused elsewhere
+        public:
+            MappedFile() :
+                bytes {nullptr}, length {0}, handle {nullptr} {}
+            ~MappedFile();
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+            
+            bool open(const std::string& path);
+            void close();
+            inline const uint8_t *data() const
+            {
+                return bytes;
+            }
+            inline size_t size() const
+            {
+                return length;
+            }
+    };
+    
+}
+
+#endif
\ No newline at end of file
@@ -1,7 +1,10 @@
 #ifndef _H_MIDI
 #define _H_MIDI
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <initializer_list>
 #include <istream>
 #include <memory>
 #include <vector>
@@ -25,6 +28,36 @@ namespace Midi {
             float miliseconds(uint32_t ticks, uint32_t usecPerQNote) const;
     };
     
+    const static uint32_t DEFAULT_TEMPO = 500000; // Microseconds per quarter note
+    
+    /*
+     * Absolute time of any tick under a song's tempo changes. Each time is
+     * measured from the change before it rather than summed gap by gap, so
+     * it never drifts however long the song.
+     */
+    class TempoMap {
+        private:
+            struct Segment {
+                public:
+                    uint64_t tick; // Where this tempo takes over
+                    double seconds; // and when
+                    double secondsPerTick;
+            };
+            MidiHeader header;
+            std::vector<Segment> segments;
+            double tickLength(uint32_t usecPerQNote) const;
+        public:
+            TempoMap(const MidiHeader& header);
+            
+            // Changes must come in tick order; SMPTE timing ignores them
+            void change(uint64_t tick, uint32_t usecPerQNote);
+            double seconds(uint64_t tick) const;
+            inline uint64_t sample(uint64_t tick, float samplerate) const // Rounded down
+            {
+                return seconds(tick) * samplerate;
+            }
+    };
+    
     enum MessageType {
         NOTE_OFF = 0x80,
         NOTE_ON = 0x90,
@@ -37,19 +70,115 @@ namespace Midi {
         TEMPO = 0xFF51, // 3 Bytes
     };
     
+    // Packed event with its data inline; every event the synth keeps has at most 3 data bytes
     struct MidiMessage {
         public:
             uint32_t deltaTime;
             uint16_t msgType;
-            std::vector<uint8_t> data;
-            MidiMessage(uint32_t deltaTime, uint16_t msgType, const std::vector<uint8_t>& data) :
-                deltaTime {deltaTime}, msgType {msgType}, data {data} {}
+            uint8_t length;
+            uint8_t data[3];
+            MidiMessage(uint32_t deltaTime, uint16_t msgType, const uint8_t *bytes, size_t count) :
+                deltaTime {deltaTime}, msgType {msgType}, length {(uint8_t)std::min<size_t>(count, 3)}, data {}
+            {
+                for (size_t i = 0; i < length; i++) {
+                    data[i] = bytes[i];
+                }
+            }
+            MidiMessage(uint32_t deltaTime, uint16_t msgType, std::initializer_list<uint8_t> bytes = {}) :
+                MidiMessage(deltaTime, msgType, bytes.begin(), bytes.size()) {}
+    };
+    
+    // Fixed-size record of one event, decoded in place from a file's bytes
+    struct MidiEvent {
+        public:
+            uint32_t deltaTime; // Ticks since the previous event in the chunk
+            uint16_t msgType; // Status byte, or 0xFF00 | type for meta events and the status for sysex
+            uint8_t length; // Data bytes held inline, at most 3
+            uint8_t data[3];
+            uint32_t offset; // Meta or sysex payload's place in the parsed buffer
+            uint32_t size; // and its length, 0 for channel messages
+    };
+    
+    // Cursor over the events of one MTrk chunk, which must outlive it
+    class TrackReader {
+        private:
+            const uint8_t *base; // Start of the whole buffer, which offsets count from
+            const uint8_t *cursor;
+            const uint8_t *end;
+            uint16_t running; // Status for running status, 0 if none yet
+            bool failed;
+        public:
+            TrackReader(const uint8_t *base = nullptr, const uint8_t *chunk = nullptr, size_t size = 0) :
+                base {base}, cursor {chunk}, end {chunk + size}, running {0}, failed {false} {}
+            
+            // Decodes the next event, returning false at the end of the chunk or on malformed data
+            bool next(MidiEvent& event);
+            inline bool good() const
+            {
+                return !failed;
+            }
+            inline size_t remaining() const // Bytes left in the chunk
+            {
+                return end - cursor;
+            }
+    };
+    
+    // Walks the chunks of a MIDI file held in memory, such as a MappedFile, without copying it
+    class MidiParser {
+        private:
+            const uint8_t *data;
+            size_t size;
+            size_t position;
+        public:
+            MidiParser(const uint8_t *data, size_t size) :
+                data {data}, size {size}, position {0} {}
+            
+            bool readHeader(MidiHeader& header);
+            // Points reader at the next MTrk chunk, skipping any others
+            bool nextTrack(TrackReader& reader);
+    };
+    
+    // Merges tracks lazily in time order, earlier tracks first on ties; the tracks must outlive it
+    class EventStream {
+        private:
+            struct Cursor {
+                public:
+                    uint64_t time; // Absolute tick of the track's next event
+                    size_t track;
+                    bool operator>(const Cursor& other) const
+                    {
+                        return time != other.time ? time > other.time : track > other.track;
+                    }
+            };
+            const std::vector<std::vector<MidiMessage>> *tracks; // Null when reading chunks
+            std::vector<TrackReader> readers;
+            std::vector<size_t> indices;
+            std::vector<MidiMessage> pending; // Next event of each track
+            std::vector<Cursor> heap;
+            uint64_t time; // Of the last event yielded
+            bool load(size_t track);
+            void start(size_t count);
+        public:
+            EventStream(const std::vector<std::vector<MidiMessage>>& tracks);
+            // Decodes each chunk only as far as the merge has reached
+            EventStream(const std::vector<TrackReader>& readers);
+            
+            // The next event with its delta from the one before, or false once every track is done
+            bool next(MidiMessage& msg);
+            // False if a chunk turned out malformed before its end
+            bool good() const;
     };
     
     bool readHeader(std::istream& stream, MidiHeader& header);
     bool readTrack(std::istream& stream, std::vector<MidiMessage>& track);
+    // Appends the events the synth plays, with the deltas of the others folded into them
+    bool readTrack(TrackReader& reader, std::vector<MidiMessage>& track);
+    // Reads just the next of those events, false at the end of the chunk
+    bool readMessage(TrackReader& reader, MidiMessage& msg);
     std::vector<MidiMessage> joinTracks(const std::vector<std::vector<MidiMessage>>& tracks);
     int maxPolyphony(const std::vector<MidiMessage>& msgs);
+    // Reads stream to its end, so pass a copy to play it afterwards
+    int maxPolyphony(EventStream& stream);
     float noteToFrequency(int midiNote, int cents);
     
 }
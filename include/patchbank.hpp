@@ -0,0 +1,65 @@
+#ifndef _H_PATCHBANK
+#define _H_PATCHBANK
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "synthutil.hpp"
+
+namespace Synth {
+    
+    /*
+     * Binary patch banks: a versioned little-endian layout that loads in one
+     * pass over the bytes, straight from a mapping, with no text to parse.
+     *
+     *   "SPBK", u16 version, u16 reserved, u32 patch count, u32 offset of each patch
+     *   Patch:    u32 synth count, synths
+     *   Synth:    u8 shape, 3 padding bytes, envelopes A, W, O, LFOs V, T
+     *   Envelope: u32 point count, u32 sustain point, f32 time and level per point
+     *   LFO:      f32 frequency, depth, offset, dc, u32 shape
+     *
+     * Every field is 4-byte aligned, and shapes are the ids the text format uses.
+     */
+    class PatchBank {
+        private:
+            static void write(std::vector<uint8_t>& out, const Envelope& envelope);
+            static void write(std::vector<uint8_t>& out, const LFO& lfo);
+            static void write(std::vector<uint8_t>& out, const Synth& synth);
+        public:
+            const static uint16_t VERSION = 1;
+            
+            static std::vector<uint8_t> write(const std::vector<Patch>& patches);
+            static bool write(std::ostream& stream, const std::vector<Patch>& patches);
+            // Appends the bank's patches, or returns false having added none
+            static bool read(const uint8_t *data, size_t size, std::vector<Patch>& patches);
+            static bool read(const std::string& path, std::vector<Patch>& patches);
+            // Text patches in, binary bank out; false, writing nothing, if any fails to parse
+            static bool convert(std::istream& text, std::ostream& bank);
+    };
+    
+    typedef std::shared_ptr<const std::vector<Patch>> SharedPatches;
+    
+    /*
+     * Process-wide cache of loaded patches, keyed by a hash of the bank or text
+     * file's contents and holding a copy of them to confirm a match. Concurrent
+     * loads of the same contents wait on a single parse and share one immutable
+     * copy, so renders hold no patches of their own.
+     */
+    class PatchCache {
+        public:
+            static SharedPatches load(const std::string& path); // Null if the file can't be read
+            // A bank, else text patches. Null for a malformed bank; malformed text throws the
+            // parser's error, as it does in every load waiting on the same parse.
+            static SharedPatches load(const uint8_t *data, size_t size);
+            static size_t size(); // Distinct contents held
+            static void clear(); // Drops the cache's references; patches in use live on
+    };
+    
+}
+
+#endif
\ No newline at end of file
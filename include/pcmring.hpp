@@ -0,0 +1,42 @@
+#ifndef _H_PCMRING
+#define _H_PCMRING
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Synth {
+    
+    /*
+     * FIFO of integer PCM between the renderer's float blocks and an encoder
+     * that takes whole frames at a time. Samples are converted as they are
+     * written, straight into the ring, and read out into a vector the caller
+     * reuses, so once both have grown to the largest block nothing allocates.
+     */
+    class PcmRing {
+        private:
+            std::vector<int32_t> ring;
+            size_t mask;
+            size_t head; // Next sample to read
+            size_t tail; // Next sample to write
+            void grow(size_t count);
+        public:
+            PcmRing(size_t capacity = 1 << 16); // Rounded up to a power of two
+            
+            // Appends count samples scaled by scale, clamped and truncated; grows only when full
+            void write(const float *samples, float scale, size_t count);
+            // Replaces out with the first count samples, which it drops
+            void read(std::vector<int32_t>& out, size_t count);
+            inline size_t size() const
+            {
+                return tail - head;
+            }
+            inline size_t capacity() const
+            {
+                return ring.size();
+            }
+    };
+    
+}
+
+#endif
\ No newline at end of file
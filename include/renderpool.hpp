@@ -0,0 +1,40 @@
+#ifndef _H_RENDERPOOL
+#define _H_RENDERPOOL
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Synth {
+    
+    class RenderPool {
+        private:
+            std::vector<std::thread> workers;
+            std::mutex mutex;
+            std::condition_variable wake;
+            std::condition_variable done;
+            const std::function<void(size_t)> *job;
+            size_t generation;
+            size_t pending;
+            bool stopping;
+            void work(size_t id);
+        public:
+            RenderPool(size_t threads = 1); // Counts the calling thread; 0 uses every core
+            ~RenderPool();
+            RenderPool(const RenderPool&) = delete;
+            RenderPool& operator=(const RenderPool&) = delete;
+            
+            // Runs job(id) once on each thread, the caller being id 0, and returns when all finish
+            void run(const std::function<void(size_t)>& job);
+            inline size_t size() const
+            {
+                return workers.size() + 1;
+            }
+    };
+    
+}
+
+#endif
\ No newline at end of file
@@ -1,32 +1,64 @@
 #ifndef _H_SYNTH
 #define _H_SYNTH
 
-#include <map>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
 #include <ostream>
+#include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "aviutil.hpp"
 
+#include "eventqueue.hpp"
+#include "mappedfile.hpp"
+#include "pcmring.hpp"
 #include "midi.hpp"
+#include "renderpool.hpp"
 
 namespace Synth {
     
     const static float USEC_TO_MSEC = 0.001,
         SEC_TO_MSEC = 1000.0;
     
-    class PlayingNote;
+    const static size_t MAX_CONTROL_BLOCK = 256, // Most samples rendered per modulator update
+        DEFAULT_CONTROL_BLOCK = 32,
+        RENDER_CHUNK = 4096, // Samples each voice renders between mixes when playing
+        BATCH_VOICES = 8, // Voices a thread renders in lockstep
+        LIVE_VOICES = 32; // Polyphony of a live Renderer given no maxVoices
+    
+    class VoicePool;
+    class PatchBank;
+    struct PatchState;
     
     typedef float (*floatfunc)(float); // Function that takes a float and returns a float
     typedef float (*resfunc)(float, float, float); // Function that takes phase, wave param, and previous sample, and returns a float
     typedef void (*callback)(const std::vector<float>&, void*,
-        const std::map<std::pair<int, int>, PlayingNote>& notes); // Function that consumes samples
+        const VoicePool& notes); // Function that consumes samples
+
+    struct EnvelopeCursor {
+        public:
+            size_t stage; // Compiled segment being played
+            float elapsed; // Time spent in that segment
+    };
 
     class Envelope {
         private:
+            struct Segment {
+                public:
+                    float start;
+                    float slope;
+                    float duration;
+            };
             std::vector<std::pair<float, float>> envelope; // Pairs of time-amplitude
             size_t sustainId; // envelope# after which to sustain
             float releaseTime;
+            std::vector<Segment> segments; // Attack stages, the sustain hold, then release stages
+            size_t releaseId; // First release segment
+            void compile();
         public:
             Envelope(
                     const std::vector<std::pair<float, float>>& env = {{0, 1}},
@@ -36,13 +68,18 @@ namespace Synth {
                     for (size_t i = sustainId + 1; i < envelope.size(); i++) {
                         releaseTime += envelope[i].first;
                     }
+                    compile();
             }
             
             static Envelope read(std::istream& stream);
             
             float amplitude(float elapsedTime, bool isActive) const;
             bool isAlive(float elapsedTime, bool isActive) const;
+            void seek(EnvelopeCursor& cursor, float elapsedTime, bool isActive) const; // O(stages)
+            float advance(EnvelopeCursor& cursor, float timeDelta) const; // O(1) per stage crossed
+            bool isAlive(const EnvelopeCursor& cursor) const; // Not yet in the final silence
             friend std::ostream& operator<<(std::ostream& stream, const Envelope& obj);
+            friend class PatchBank;
     };
     
     std::ostream& operator<<(std::ostream& stream, const Envelope& obj);
@@ -74,6 +111,7 @@ namespace Synth {
             
             static LFO silence;
             friend std::ostream& operator<<(std::ostream& stream, const LFO& obj);
+            friend class PatchBank;
     };
     
     std::ostream& operator<<(std::ostream& stream, const LFO& obj);
@@ -102,14 +140,34 @@ namespace Synth {
             float waveParam(float time, float eTime, bool isActive) const;
             bool isAlive(float eTime, bool isActive) const;
             
+            bool isAlive(const PatchState& state) const; // By the amplitude cursor
+            void seek(PatchState& state) const; // Points the envelope cursors at state.eTime
+            void modulate(PatchState& state, float timeDelta,
+                float& amplitude, float& param, float& rate) const; // Advances the cursors
+            
+            // Fills out with amplitude-scaled samples, updating previous. phaseDelta is the
+            // largest phase step in the block, which picks the band-limited wavetable level.
+            // Noise is drawn from the stream seed picks, clock being the first sample's place in it.
+            void render(const float *phase, const float *param, const float *amplitude,
+                float phaseDelta, float& previous, uint32_t seed, uint64_t clock, float *out,
+                size_t count) const;
+            
             static float sinSaw(float phase, float param, float previous);
             static float resonantSaw(float phase, float param, float previous);
             static float noise(float phase, float param, float previous);
+            static float wavetable(float phase, float param, float previous);
             friend std::ostream& operator<<(std::ostream& stream, const Synth& obj);
+            friend class PatchBank;
     };
     
     std::ostream& operator<<(std::ostream& stream, const Synth& obj);
     
+    // Shapes by the ids patch files give them
+    const static floatfunc LFO_SHAPES[] = {LFO::sine, LFO::sawUp, LFO::sawDown, LFO::triangle, LFO::zero};
+    const static resfunc SYNTH_SHAPES[] = {Synth::sinSaw, Synth::resonantSaw, Synth::noise, Synth::wavetable};
+    const static size_t NUM_LFO_SHAPES = 5,
+        NUM_SYNTH_SHAPES = 4;
+    
     struct PatchState {
         public:
             float phase;
@@ -117,6 +175,22 @@ namespace Synth {
             float time;
             float eTime;
             bool isActive;
+            EnvelopeCursor dca, dcw, dco;
+            uint64_t clock; // Samples rendered since the note began
+            uint64_t eClock; // Samples rendered since the note began or was released
+            float amplitude; // Modulator values at the end of the control block, valid once primed
+            float param;
+            float rate; // Frequency multiplier from pitch modulation
+            float ampStart, ampStep; // Ramps across the control block
+            float paramStart, paramStep;
+            float blockPhase; // Phase at the start of the control block
+            float phaseDelta, phaseGrowth; // Phase step of the block's first sample, and the log of its ratio per sample
+            float phaseScale; // Turns phaseGrowth into the phase of a sample, see blockPhase
+            float peakDelta; // Largest phase step in the control block
+            size_t offset; // Samples rendered of the control block
+            size_t length; // Samples in the control block
+            bool primed;
+            uint32_t seed; // Picks the voice's noise stream
     };
     
     class Patch {
@@ -129,66 +203,456 @@ namespace Synth {
             static Patch read(std::istream& stream);
             
             bool operator()(PatchState& state, float frequency, float samplerate) const;
+            // Renders count samples, at most to the end of the current control block. When a block
+            // starts, its modulators are sampled at its end, blockLength samples on, and ramped from
+            // the previous block's values, linearly for amplitude and wave param and geometrically
+            // for the phase step. A block renders the same however its samples are split across
+            // calls, and the note only reports itself dead at the end of a block. A null out skips
+            // to where rendering would leave the state, in constant time per block, without
+            // synthesising anything. count must not run past the end of the block.
+            bool render(PatchState& state, float frequency, float samplerate, float *out, size_t count,
+                size_t blockLength) const;
+            // The first half of render: advances state as it does, filling the inputs of the returned
+            // synth's render unless phases is null. The arrays need room for count rounded up to 8.
+            const Synth& ramp(PatchState& state, float frequency, float samplerate, size_t count,
+                size_t blockLength, float *phases, float *params, float *amplitudes, bool& alive) const;
+            // Ends the control block at the sample render has reached, keeping its phase, so the
+            // next block starts from there
+            void endBlock(PatchState& state) const;
+            bool usesNoise() const; // Its filter state means a skip has to run the samples
             friend std::ostream& operator<<(std::ostream& stream, const Patch& obj);
+            friend class PatchBank;
     };
     
     std::ostream& operator<<(std::ostream& stream, const Patch& obj);
     
     class PlayingNote {
         private:
-            const Patch& patch;
+            const Patch *patch;
             float frequency;
             bool isAlive; // Can still be heard
             PatchState state;
+            int channel, note; // MIDI key that started it
+            uint32_t fadeLeft, fadeLength; // Samples of a fade out, both 0 unless stolen
+            void fadeOut(float *dst, size_t count);
         public:
             PlayingNote(const Patch& patch, float frequency, float phase = 0,
-                bool isAlive = true, bool isActive = true) :
-            patch {patch},
+                bool isAlive = true, bool isActive = true, int channel = 0, int note = 0,
+                uint32_t seed = 0) :
+            patch {&patch},
             frequency {frequency},
             isAlive {isAlive},
-            state {phase, 0.0, 0.0, 0.0, isActive}
-            {}
+            state {phase, 0.0, 0.0, 0.0, isActive},
+            channel {channel},
+            note {note},
+            fadeLeft {0},
+            fadeLength {0}
+            {
+                state.seed = seed;
+            }
             
-            void writeFloats(std::vector<float>& dst, float samplerate, int maxNotes);
+            void writeFloats(std::vector<float>& dst, float samplerate, int maxNotes,
+                size_t controlBlock = DEFAULT_CONTROL_BLOCK);
+            // Overwrites dst, which starts position samples into the song. Control blocks
+            // fall on multiples of controlBlock, counted from the start of the song.
+            void render(float *dst, size_t count, float samplerate, size_t controlBlock, uint64_t position);
+            void advance(size_t count, float samplerate, size_t controlBlock, uint64_t position); // Renders nothing
+            // Renders up to BATCH_VOICES voices into their own dst, as each one's render would, a
+            // control block at a time in lockstep. Voices sharing a kernel shape share its calls.
+            static void render(PlayingNote *const *voices, float *const *dst, size_t n, size_t count,
+                float samplerate, size_t controlBlock, uint64_t position);
+            inline const Patch& getPatch() const
+            {
+                return *patch;
+            }
+            inline int getChannel() const
+            {
+                return channel;
+            }
+            inline int getNote() const
+            {
+                return note;
+            }
+            inline uint64_t age() const // In samples
+            {
+                return state.clock;
+            }
+            inline bool released() const
+            {
+                return !state.isActive;
+            }
+            inline bool fading() const
+            {
+                return fadeLength;
+            }
+            float level() const; // Amplitude at the end of the last control block, infinite before the first
+            inline void fade(uint32_t length) // Ramps to silence over length samples, then dies
+            {
+                fadeLeft = fadeLength = std::max(length, uint32_t{1});
+            }
             inline bool alive()
             {
                 return isAlive;
             }
             inline void stop()
             {
+                if (!state.isActive) {
+                    return; // Already releasing; a repeated note off must not restart it
+                }
                 state.isActive = false;
                 state.eTime = 0;
+                state.eClock = 0;
+                patch->endBlock(state); // The release starts its own block on the next sample
+                state.primed = false;
+            }
+    };
+    
+    enum StealPolicy {
+        STEAL_OLDEST = 0, // The voice started longest ago
+        STEAL_QUIETEST = 1, // The voice with the lowest amplitude envelope
+        STEAL_RELEASED = 2 // The quietest released voice, else the oldest
+    };
+    
+    /*
+     * The sounding voices, stored contiguously with room for them reserved up
+     * front, so starting and retiring notes never allocates. A channel and
+     * note table finds a key's voice in constant time, and dead voices are
+     * swap-removed, so voice order is not note order.
+     *
+     * Past capacity voices, a new note steals one by the policy. The stolen
+     * voice fades out over fadeLength samples beside the others, so at most
+     * twice capacity voices render at once; with no fade, or no room left for
+     * one, it is cut off.
+     */
+    class VoicePool {
+        private:
+            std::vector<PlayingNote> voices;
+            std::vector<int> slots; // Voice index per channel and note, -1 for none
+            size_t capacity;
+            size_t live; // Voices not fading out
+            StealPolicy policy;
+            uint32_t fadeLength;
+            static size_t key(int channel, int note);
+            int victim() const;
+        public:
+            const static size_t KEYS = 16 * 128; // Every channel and note, so no key is ever turned away
+            
+            VoicePool(size_t capacity = KEYS, StealPolicy policy = STEAL_RELEASED, uint32_t fadeLength = 0);
+            // Copies keep the reservation
+            VoicePool(const VoicePool& other);
+            VoicePool& operator=(const VoicePool& other);
+            
+            PlayingNote *find(int channel, int note);
+            // Retriggers a key that is still sounding. Returns false, dropping the note, only when
+            // there is no voice to steal.
+            bool start(const Patch& patch, float frequency, int channel, int note, uint32_t seed = 0);
+            void removeDead();
+            
+            inline size_t size() const
+            {
+                return voices.size();
+            }
+            inline size_t room() const // Voices it holds without allocating, fading ones included
+            {
+                return voices.capacity();
+            }
+            inline PlayingNote& operator[](size_t index)
+            {
+                return voices[index];
+            }
+            inline const PlayingNote *begin() const
+            {
+                return voices.data();
+            }
+            inline const PlayingNote *end() const
+            {
+                return voices.data() + voices.size();
             }
     };
     
     std::vector<Patch> readPatches(std::istream& stream);
     
+    /*
+     * A merged track compiled once against its tempo map into the sample
+     * each event lands on. Renders at the same rate can share it, and
+     * finding the event at a time is a binary search.
+     */
+    struct Timeline {
+        public:
+            Midi::MidiHeader header;
+            float samplerate;
+            std::vector<Midi::MidiMessage> track;
+            std::vector<uint64_t> samples; // Where each event of track lands, rounded down
+            
+            Timeline(const Midi::MidiHeader& header, float samplerate) :
+                header {header}, samplerate {samplerate} {}
+            Timeline(const std::vector<Midi::MidiMessage>& track, const Midi::MidiHeader& header,
+                float samplerate);
+            // Index of the first event landing at or after sample
+            size_t find(uint64_t sample) const;
+    };
+    
+    /*
+     * Everything the sequencer carries from one event to the next. A copy
+     * taken between two events resumes the song from there exactly.
+     */
+    struct SequencerState {
+        public:
+            uint8_t programs[16]; // Patch per channel
+            VoicePool voices;
+            Midi::TempoMap tempo; // Changes so far
+            uint64_t tick; // Ticks into the song
+            uint64_t position; // Samples into the song
+            uint32_t seed; // Mixed into the noise seed of every note
+            
+            SequencerState(const VoicePool& voices, const Midi::MidiHeader& header, uint32_t seed = 0);
+            // The sample msg lands on if it is the next event, as a Timeline would place it
+            uint64_t when(const Midi::MidiMessage& msg, float samplerate) const;
+            void apply(const Midi::MidiMessage& msg, const std::vector<Patch>& patches);
+            // Starts or stops a note; other messages are ignored
+            void channelEvent(uint16_t msgType, const uint8_t *data, const std::vector<Patch>& patches);
+    };
+    
+    struct RenderOptions {
+        public:
+            size_t controlBlock = DEFAULT_CONTROL_BLOCK; // Samples per modulator update, up to MAX_CONTROL_BLOCK
+            size_t threads = 1; // Rendering threads, 0 for one per core
+            size_t slices = 0; // Segments for renderSliced, 0 for a few per thread
+            size_t maxVoices = 0; // Voices sounding at once, beyond which notes steal one; 0 for no limit
+            StealPolicy steal = STEAL_RELEASED;
+            uint32_t seed = 0; // Picks the noise of every note, so renders with one seed match
+            bool scan = false; // Files only: size voices from the whole song as play() does, decoding it first
+    };
+    
+    struct Stems {
+        public:
+            std::vector<std::vector<float>> channels; // Per MIDI channel, empty for channels with no notes
+            std::vector<float> mix; // Sum of the channels
+    };
+    
     void play(std::istream& midiStream,
         float samplerate,
         callback func,
         const std::vector<Patch>& patches,
-        void *data);
+        void *data,
+        const RenderOptions& options = {});
     
     void play(const std::vector<Midi::MidiMessage>& msgs,
         const Midi::MidiHeader& header,
         float samplerate,
         callback func,
         const std::vector<Patch>& patches,
-        void *data);
+        void *data,
+        const RenderOptions& options = {});
+    
+    void play(const Timeline& timeline,
+        callback func,
+        const std::vector<Patch>& patches,
+        void *data,
+        const RenderOptions& options = {});
+    
+    // Streams the file at path as a Renderer does, passing func a RENDER_CHUNK of samples at a time.
+    // False if the file could not be read, having played none of it, or a track of it broke off.
+    bool playFile(const std::string& path,
+        float samplerate,
+        callback func,
+        const std::vector<Patch>& patches,
+        void *data,
+        const RenderOptions& options = {});
+    
+    // Renders each channel on its own thread into a stem, every stem spanning the whole song
+    Stems renderStems(const std::vector<Midi::MidiMessage>& msgs,
+        const Midi::MidiHeader& header,
+        float samplerate,
+        const std::vector<Patch>& patches,
+        const RenderOptions& options = {});
+    
+    // Cuts the song into slices between events, finds the voices live at each cut with a
+    // dry pass that synthesises nothing, then renders the slices concurrently. The result
+    // matches what play() passes to its callback, concatenated.
+    std::vector<float> renderSliced(const std::vector<Midi::MidiMessage>& msgs,
+        const Midi::MidiHeader& header,
+        float samplerate,
+        const std::vector<Patch>& patches,
+        const RenderOptions& options = {});
     
+    std::vector<float> renderSliced(const Timeline& timeline,
+        const std::vector<Patch>& patches,
+        const RenderOptions& options = {});
+    
+    /*
+     * Pulls a song out in blocks of any size the caller likes, such as an
+     * audio device's buffer, with each event applied on its exact sample
+     * within a block. Rendering allocates nothing; the mix buffers are sized
+     * for the voice pool up front. patches must outlive the renderer.
+     */
+    class Renderer {
+        private:
+            Timeline timeline;
+            const std::vector<Patch>& patches;
+            size_t controlBlock;
+            int maxNotes;
+            RenderPool pool;
+            SequencerState state;
+            size_t next; // Index of the next event
+            std::vector<float> slots;
+            EventQueue *events; // Live input, null when playing a track
+            MappedFile file;
+            Midi::EventStream stream; // Merges the file's tracks as it plays
+            Midi::MidiMessage pending; // Next event from the stream
+            bool streaming; // Whether pending holds one
+            bool valid;
+            struct Checkpoint {
+                public:
+                    SequencerState state;
+                    size_t next;
+                    Midi::EventStream stream;
+                    Midi::MidiMessage pending;
+                    bool streaming;
+            };
+            std::vector<Checkpoint> checkpoints; // The start, then more taken while seeking, by position
+            uint64_t schedule();
+            void save();
+            void restore(const Checkpoint& checkpoint);
+            bool open(const std::string& path, const RenderOptions& options);
+        public:
+            Renderer(const std::vector<Midi::MidiMessage>& msgs,
+                const Midi::MidiHeader& header,
+                float samplerate,
+                const std::vector<Patch>& patches,
+                const RenderOptions& options = {});
+            Renderer(const Timeline& timeline,
+                const std::vector<Patch>& patches,
+                const RenderOptions& options = {});
+            // Plays whatever arrives on events, with options.maxVoices voices (LIVE_VOICES if 0)
+            // always stealing
+            Renderer(EventQueue& events,
+                float samplerate,
+                const std::vector<Patch>& patches,
+                const RenderOptions& options = {});
+            // Plays a MIDI file straight from a mapping, decoding each track only as far as it has
+            // played, so it starts at once and its memory is bounded by the track count. Voices
+            // are limited as for live input, and the mix scaled by that limit, unless options.scan
+            // sizes both from a pass over the whole song first, matching play() but starting later.
+            // Plays nothing if the file is missing or malformed; see good().
+            Renderer(const std::string& path,
+                float samplerate,
+                const std::vector<Patch>& patches,
+                const RenderOptions& options = {});
+            Renderer(const Renderer&) = delete;
+            Renderer& operator=(const Renderer&) = delete;
+            
+            // Fills out with frames samples, silent past the last event. Returns how many came
+            // before it, so fewer than frames means the song is over. Live events land on
+            // their own sample, or on the first one rendered after they arrive if that has passed.
+            size_t render(float *out, size_t frames);
+            // Moves to sample without synthesising what it skips, leaving every voice sounding
+            // there as it would have been had the song been rendered up to it. Costs a fraction
+            // of rendering the skipped part, and seeking again starts from the nearest point
+            // passed before. False for live input.
+            bool seek(uint64_t sample);
+            inline bool finished() const
+            {
+                return !events && !streaming && next == timeline.track.size();
+            }
+            inline uint64_t position() const // Samples rendered
+            {
+                return state.position;
+            }
+            inline const VoicePool& voices() const
+            {
+                return state.voices;
+            }
+            // False if the path held no well-formed MIDI file, or once a track turns out malformed
+            // while playing, the rest of which is dropped
+            inline bool good() const
+            {
+                return valid && stream.good();
+            }
+    };
+    
+    // Renders samples [begin, end) of the song alone, as they would come out of play()
+    std::vector<float> renderRange(const Timeline& timeline,
+        uint64_t begin,
+        uint64_t end,
+        const std::vector<Patch>& patches,
+        const RenderOptions& options = {});
+    
+    /*
+     * Base for visualizers that write the song to an AVI. The callback draws
+     * frames into buffers from nextFrame and queues audio with writeSamples.
+     * A writer thread hands them to the AVI writer in the same order, while a
+     * pool of encoder threads runs encodeFrame on queued frames side by side.
+     * The encoders only serve encodeFrame: the AVI's own MJPEG frames are still
+     * compressed one at a time by writeVideoFrame on the writer thread, since
+     * it takes raw RGB, so they write no faster however many encoders run.
+     * Synthesis only waits once queueLength outputs are in flight, which bounds
+     * the frames held. The buffers are reused. finish writes everything queued;
+     * destroying the visualizer without it drops whatever was still unsent.
+     */
     class Visualizer {
+        private:
+            struct Output {
+                public:
+                    std::vector<std::uint8_t> rgb; // Video frames only
+                    std::vector<int32_t> samples; // Audio only
+                    bool video;
+                    bool encoded; // Done with by the encoders
+                    int frame; // Video frames queued before this one
+            };
+            std::vector<Output> outputs; // Ring of queued outputs
+            size_t head; // Oldest still in use
+            size_t written; // Next for the writer
+            size_t claimed; // Next for an encoder
+            size_t tail; // Next for the callback
+            int frames; // Frames queued
+            bool stopping;
+            bool dropping; // Stopping without writing what is left
+            std::mutex mutex;
+            std::condition_variable queued;
+            std::condition_variable freed;
+            std::thread writer;
+            std::vector<std::thread> encoders;
+            Output& reserve(); // Waits for a free output
+            void submit();
+            void release(); // Frees outputs both written and encoded; needs the lock
+            void write();
+            void encode(size_t encoder);
+            void join(bool drain); // Stops the threads once idle, having first written the queue if drain
         protected:
             float samplerate;
             float framerate;
             float sampleNorm;
             int bps;
             int width, height;
-            std::vector<int32_t> buffer;
-            std::vector<std::uint8_t> rgb;
+            PcmRing buffer; // Samples not yet queued
             Avi::FlacMjpegAvi fmavi;
             std::ostream& out;
+            
+            // Converts samples to PCM on the end of buffer
+            inline void queueSamples(const std::vector<float>& samples)
+            {
+                buffer.write(samples.data(), sampleNorm, samples.size());
+            }
+            void writeSamples(size_t count); // Queues the first count samples of buffer
+            std::vector<std::uint8_t>& nextFrame(); // Buffer for the next frame, its contents stale
+            void writeFrame(); // Queues the frame drawn into nextFrame, with nothing queued between
+            inline size_t encoderCount() const
+            {
+                return encoders.size();
+            }
+            // Runs once per frame on one of the encoder threads, alongside other frames and the
+            // AVI writer, for output of the subclass's own; encoder numbers the thread, so each
+            // can keep its own state
+            virtual void encodeFrame(const std::vector<std::uint8_t>& rgb, int frame, size_t encoder) {}
+            // Joins the threads, dropping the outputs they have not taken. A subclass overriding
+            // encodeFrame calls it from its destructor, so no frame encodes once it is gone.
+            void stop();
         
         public:
+            const static size_t QUEUED_OUTPUTS = 8,
+                ENCODERS = 1;
+            
             Visualizer(
                 float samplerate,
                 float fps,
@@ -196,35 +660,20 @@ namespace Synth {
                 int height,
                 int bps,
                 std::ostream& stream,
-                int jpegQuality = 90) :
-            samplerate {samplerate},
-            framerate {fps},
-            bps {bps},
-            width {width},
-            height {height},
-            sampleNorm ((1 << (bps - 1)) - 1),
-            rgb (width * height * 3),
-            out {stream},
-            fmavi {
-                width, height, fps, bps, samplerate, 1, Avi::NORMAL, jpegQuality
-            } {
-                fmavi.prepare(out);
-            }
+                int jpegQuality = 90,
+                size_t queueLength = QUEUED_OUTPUTS, // Outputs in flight at most, at least 2
+                size_t encoders = ENCODERS); // Threads running encodeFrame, at least 1
+            Visualizer(const Visualizer&) = delete;
+            Visualizer& operator=(const Visualizer&) = delete;
+            virtual ~Visualizer(); // Stops as stop() does
             
-            virtual ~Visualizer() {}
+            virtual void callback(const std::vector<float>& samples, const VoicePool& notes) = 0;
             
-            virtual void callback(const std::vector<float>& samples,
-                const std::map<std::pair<int, int>, PlayingNote>& notes) = 0;
-            
-            void finish()
-            {
-                fmavi.writeSamples(out, buffer);
-                fmavi.finish(out);
-            }
+            void finish(); // Writes what is left and closes the AVI
         
             static void play(const std::vector<float>& samples,
                 void *data,
-                const std::map<std::pair<int, int>, PlayingNote>& notes)
+                const VoicePool& notes)
             {
                 Visualizer *vs = static_cast<Visualizer*>(data);
                 vs->callback(samples, notes);
@@ -0,0 +1,44 @@
+#ifndef _H_WAVETABLE
+#define _H_WAVETABLE
+
+#include <cstddef>
+#include <vector>
+
+namespace Synth {
+    
+    /*
+     * Band-limited single-cycle tables for the wavetable shape.
+     * Each frame is kept at one mip level per octave, the highest level
+     * holding only the fundamental. A voice reads the level whose top
+     * harmonic stays under Nyquist for its pitch, and the wave param
+     * morphs across frames in order, so 0 is a sine and 3 a square.
+     */
+    class Wavetable {
+        public:
+            const static size_t TABLE_SIZE = 2048, // Samples per cycle, a power of 2
+                HARMONICS = 512, // Harmonics at level 0
+                LEVELS = 10,
+                FRAMES = 4;
+            
+            enum Frame {
+                SINE = 0,
+                TRIANGLE = 1,
+                SAW = 2,
+                SQUARE = 3
+            };
+            
+            static const Wavetable& bank(); // Built on first use
+            static size_t level(float phaseDelta); // Mip level for a phase step in radians per sample
+            
+            const float *table(size_t level, size_t frame) const;
+            float operator()(float phase, float param, size_t level = 0) const;
+            void render(const float *phase, const float *param, float phaseDelta, float *out, size_t count) const;
+        
+        private:
+            std::vector<float> tables; // LEVELS x FRAMES tables of TABLE_SIZE + 1 samples
+            Wavetable();
+    };
+    
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,49 @@
+#include <atomic>
+#include <cstddef>
+
+#include "eventqueue.hpp"
+
+namespace Synth {
+    
+    static size_t roundUp(size_t n)
+    {
+        size_t size = 1;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+    
+    EventQueue::EventQueue(size_t capacity) :
+        ring (roundUp(capacity)),
+        mask {ring.size() - 1},
+        head {0},
+        tail {0}
+    {}
+    
+    bool EventQueue::push(const LiveEvent& event)
+    {
+        size_t at = tail.load(std::memory_order_relaxed);
+        if (at - head.load(std::memory_order_acquire) == ring.size()) {
+            return false;
+        }
+        ring[at & mask] = event;
+        tail.store(at + 1, std::memory_order_release);
+        return true;
+    }
+    
+    const LiveEvent *EventQueue::front() const
+    {
+        size_t at = head.load(std::memory_order_relaxed);
+        if (at == tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &ring[at & mask];
+    }
+    
+    void EventQueue::pop()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    
+}
\ No newline at end of file
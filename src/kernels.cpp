@@ -0,0 +1,435 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+
+#include "kernels.hpp"
+#include "synthutil.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace Synth {
+
+    namespace Kernels {
+
+        static Isa detectIsa()
+        {
+#ifdef KERNELS_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+                return AVX2;
+            }
+            if (__builtin_cpu_supports("sse2")) {
+                return SSE2;
+            }
+#endif
+            return SCALAR;
+        }
+
+        static Isa supportedIsa()
+        {
+            static const Isa supported = detectIsa();
+            return supported;
+        }
+
+        static Isa currentIsa = supportedIsa();
+
+        Isa isa()
+        {
+            return currentIsa;
+        }
+
+        Isa setIsa(Isa isa)
+        {
+            currentIsa = isa < supportedIsa() ? isa : supportedIsa();
+            return currentIsa;
+        }
+
+        // Cody-Waite split of pi, and the odd Taylor terms of sin on [-pi/2, pi/2]
+        const static float PI_A = 3.140625f,
+            PI_B = 9.67502593994140625e-4f,
+            PI_C = 1.509957990978376432e-7f,
+            INV_PI = 0.318309886183790672f,
+            INV_TWO_PI = 0.159154943091895336f,
+            SIN_3 = -1.0f / 6,
+            SIN_5 = 1.0f / 120,
+            SIN_7 = -1.0f / 5040,
+            SIN_9 = 1.0f / 362880,
+            SIN_11 = -1.0f / 39916800;
+
+        // Noise draws take the top 24 bits of a hash, which floats hold exactly, to [0, 1]
+        const static float NOISE_SCALE = 1.0f / 16777215;
+        const static uint32_t PCG_MULTIPLIER = 747796405u,
+            PCG_INCREMENT = 2891336453u,
+            PCG_OUTPUT = 277803737u;
+        const static size_t NOISE_CHUNK = 256; // Draws made ahead of the filter
+
+        // One step of the 32-bit PCG generator with its RXS-M-XS output, used as a stateless hash
+        static inline uint32_t pcgHash(uint32_t input)
+        {
+            uint32_t state = input * PCG_MULTIPLIER + PCG_INCREMENT;
+            uint32_t word = ((state >> ((state >> 28) + 4)) ^ state) * PCG_OUTPUT;
+            return (word >> 22) ^ word;
+        }
+
+        // Keys the low word of the counter, the high word changing only every 2^32 samples
+        static inline uint32_t noiseKey(uint32_t seed, uint64_t counter)
+        {
+            return pcgHash(seed ^ pcgHash(counter >> 32));
+        }
+
+#ifdef KERNELS_X86
+
+        __attribute__((target("sse2")))
+        static inline __m128 truncPs(__m128 x)
+        {
+            return _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+        }
+
+        __attribute__((target("sse2")))
+        static inline __m128 sinPs(__m128 x)
+        {
+            __m128i quadrant = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(INV_PI)));
+            __m128 k = _mm_cvtepi32_ps(quadrant);
+            x = _mm_sub_ps(x, _mm_mul_ps(k, _mm_set1_ps(PI_A)));
+            x = _mm_sub_ps(x, _mm_mul_ps(k, _mm_set1_ps(PI_B)));
+            x = _mm_sub_ps(x, _mm_mul_ps(k, _mm_set1_ps(PI_C)));
+            __m128 sign = _mm_castsi128_ps(_mm_slli_epi32(quadrant, 31));
+            __m128 x2 = _mm_mul_ps(x, x);
+            __m128 poly = _mm_add_ps(_mm_set1_ps(SIN_9), _mm_mul_ps(x2, _mm_set1_ps(SIN_11)));
+            poly = _mm_add_ps(_mm_set1_ps(SIN_7), _mm_mul_ps(x2, poly));
+            poly = _mm_add_ps(_mm_set1_ps(SIN_5), _mm_mul_ps(x2, poly));
+            poly = _mm_add_ps(_mm_set1_ps(SIN_3), _mm_mul_ps(x2, poly));
+            poly = _mm_add_ps(x, _mm_mul_ps(_mm_mul_ps(x, x2), poly));
+            return _mm_xor_ps(poly, sign);
+        }
+
+        __attribute__((target("sse2")))
+        static size_t sinSawSse2(const float *phase, const float *param, float *out, size_t count)
+        {
+            size_t i = 0;
+            for (; i + 4 <= count; i += 4) {
+                __m128 p = _mm_loadu_ps(phase + i);
+                __m128 sine = sinPs(p);
+                __m128 t = _mm_mul_ps(p, _mm_set1_ps(INV_PI));
+                __m128 wraps = truncPs(_mm_mul_ps(t, _mm_set1_ps(0.5f)));
+                __m128 saw = _mm_sub_ps(_mm_sub_ps(t, _mm_add_ps(wraps, wraps)), _mm_set1_ps(1.0f));
+                __m128 mix = _mm_mul_ps(_mm_sub_ps(saw, sine), _mm_loadu_ps(param + i));
+                _mm_storeu_ps(out + i, _mm_add_ps(sine, mix));
+            }
+            return i;
+        }
+
+        __attribute__((target("sse2")))
+        static size_t resonantSawSse2(const float *phase, const float *param, float *out, size_t count)
+        {
+            size_t i = 0;
+            for (; i + 4 <= count; i += 4) {
+                __m128 p = _mm_loadu_ps(phase + i);
+                __m128 sine = sinPs(_mm_mul_ps(p, _mm_loadu_ps(param + i)));
+                __m128 cycles = _mm_mul_ps(p, _mm_set1_ps(INV_TWO_PI));
+                __m128 ramp = _mm_sub_ps(_mm_set1_ps(1.0f), _mm_sub_ps(cycles, truncPs(cycles)));
+                _mm_storeu_ps(out + i, _mm_mul_ps(sine, ramp));
+            }
+            return i;
+        }
+
+        __attribute__((target("sse2")))
+        static size_t multiplySse2(float *dst, const float *src, size_t count)
+        {
+            size_t i = 0;
+            for (; i + 4 <= count; i += 4) {
+                _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+            }
+            return i;
+        }
+
+        __attribute__((target("sse2")))
+        static size_t toPcmSse2(int32_t *dst, const float *src, float scale, float limit, size_t count)
+        {
+            size_t i = 0;
+            __m128 s = _mm_set1_ps(scale);
+            __m128 high = _mm_set1_ps(limit);
+            __m128 low = _mm_set1_ps(-limit);
+            for (; i + 4 <= count; i += 4) {
+                __m128 x = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + i), s), low), high);
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_cvttps_epi32(x));
+            }
+            return i;
+        }
+
+        __attribute__((target("sse2")))
+        static size_t accumulateSse2(float *dst, const float *src, float scale, size_t count)
+        {
+            size_t i = 0;
+            __m128 s = _mm_set1_ps(scale);
+            for (; i + 4 <= count; i += 4) {
+                __m128 sum = _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), s));
+                _mm_storeu_ps(dst + i, sum);
+            }
+            return i;
+        }
+
+        __attribute__((target("avx2,fma")))
+        static inline __m256 truncPs(__m256 x)
+        {
+            return _mm256_round_ps(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        }
+
+        __attribute__((target("avx2,fma")))
+        static inline __m256 sinPs(__m256 x)
+        {
+            __m256 k = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(INV_PI)),
+                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            __m256i quadrant = _mm256_cvtps_epi32(k);
+            x = _mm256_fnmadd_ps(k, _mm256_set1_ps(PI_A), x);
+            x = _mm256_fnmadd_ps(k, _mm256_set1_ps(PI_B), x);
+            x = _mm256_fnmadd_ps(k, _mm256_set1_ps(PI_C), x);
+            __m256 sign = _mm256_castsi256_ps(_mm256_slli_epi32(quadrant, 31));
+            __m256 x2 = _mm256_mul_ps(x, x);
+            __m256 poly = _mm256_fmadd_ps(x2, _mm256_set1_ps(SIN_11), _mm256_set1_ps(SIN_9));
+            poly = _mm256_fmadd_ps(x2, poly, _mm256_set1_ps(SIN_7));
+            poly = _mm256_fmadd_ps(x2, poly, _mm256_set1_ps(SIN_5));
+            poly = _mm256_fmadd_ps(x2, poly, _mm256_set1_ps(SIN_3));
+            poly = _mm256_fmadd_ps(_mm256_mul_ps(x, x2), poly, x);
+            return _mm256_xor_ps(poly, sign);
+        }
+
+        __attribute__((target("avx2,fma")))
+        static size_t sinSawAvx2(const float *phase, const float *param, float *out, size_t count)
+        {
+            size_t i = 0;
+            for (; i + 8 <= count; i += 8) {
+                __m256 p = _mm256_loadu_ps(phase + i);
+                __m256 sine = sinPs(p);
+                __m256 t = _mm256_mul_ps(p, _mm256_set1_ps(INV_PI));
+                __m256 wraps = truncPs(_mm256_mul_ps(t, _mm256_set1_ps(0.5f)));
+                __m256 saw = _mm256_sub_ps(_mm256_sub_ps(t, _mm256_add_ps(wraps, wraps)), _mm256_set1_ps(1.0f));
+                _mm256_storeu_ps(out + i, _mm256_fmadd_ps(_mm256_sub_ps(saw, sine), _mm256_loadu_ps(param + i), sine));
+            }
+            return i;
+        }
+
+        __attribute__((target("avx2,fma")))
+        static size_t resonantSawAvx2(const float *phase, const float *param, float *out, size_t count)
+        {
+            size_t i = 0;
+            for (; i + 8 <= count; i += 8) {
+                __m256 p = _mm256_loadu_ps(phase + i);
+                __m256 sine = sinPs(_mm256_mul_ps(p, _mm256_loadu_ps(param + i)));
+                __m256 cycles = _mm256_mul_ps(p, _mm256_set1_ps(INV_TWO_PI));
+                __m256 ramp = _mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_sub_ps(cycles, truncPs(cycles)));
+                _mm256_storeu_ps(out + i, _mm256_mul_ps(sine, ramp));
+            }
+            return i;
+        }
+
+        __attribute__((target("avx2,fma")))
+        static size_t multiplyAvx2(float *dst, const float *src, size_t count)
+        {
+            size_t i = 0;
+            for (; i + 8 <= count; i += 8) {
+                _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(dst + i), _mm256_loadu_ps(src + i)));
+            }
+            return i;
+        }
+
+        // Built without FMA so the compiler cannot fuse it either
+        __attribute__((target("avx2")))
+        static size_t accumulateAvx2(float *dst, const float *src, float scale, size_t count)
+        {
+            size_t i = 0;
+            __m256 s = _mm256_set1_ps(scale);
+            for (; i + 8 <= count; i += 8) {
+                // Not fused, so a sum rounds the same however its terms were grouped into buffers
+                __m256 sum = _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(_mm256_loadu_ps(src + i), s));
+                _mm256_storeu_ps(dst + i, sum);
+            }
+            return i;
+        }
+
+        __attribute__((target("avx2")))
+        static size_t toPcmAvx2(int32_t *dst, const float *src, float scale, float limit, size_t count)
+        {
+            size_t i = 0;
+            __m256 s = _mm256_set1_ps(scale);
+            __m256 high = _mm256_set1_ps(limit);
+            __m256 low = _mm256_set1_ps(-limit);
+            for (; i + 8 <= count; i += 8) {
+                __m256 x = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i), s), low), high);
+                _mm256_storeu_si256((__m256i*)(dst + i), _mm256_cvttps_epi32(x));
+            }
+            return i;
+        }
+
+        __attribute__((target("avx2")))
+        static size_t noiseAvx2(uint32_t key, uint32_t first, float *out, size_t count)
+        {
+            const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            size_t i = 0;
+            for (; i + 8 <= count; i += 8) {
+                __m256i input = _mm256_add_epi32(_mm256_set1_epi32(first + i), lanes);
+                __m256i state = _mm256_mullo_epi32(_mm256_xor_si256(input, _mm256_set1_epi32(key)),
+                    _mm256_set1_epi32(PCG_MULTIPLIER));
+                state = _mm256_add_epi32(state, _mm256_set1_epi32(PCG_INCREMENT));
+                __m256i shift = _mm256_add_epi32(_mm256_srli_epi32(state, 28), _mm256_set1_epi32(4));
+                __m256i word = _mm256_xor_si256(_mm256_srlv_epi32(state, shift), state);
+                word = _mm256_mullo_epi32(word, _mm256_set1_epi32(PCG_OUTPUT));
+                word = _mm256_xor_si256(_mm256_srli_epi32(word, 22), word);
+                __m256 value = _mm256_cvtepi32_ps(_mm256_srli_epi32(word, 8));
+                _mm256_storeu_ps(out + i, _mm256_mul_ps(value, _mm256_set1_ps(NOISE_SCALE)));
+            }
+            return i;
+        }
+
+#endif
+
+#ifdef KERNELS_X86
+
+        const static size_t MAX_LANES = 8;
+
+        typedef size_t (*VectorKernel)(const float *, const float *, float *, size_t);
+
+        /*
+         * Runs a vector kernel over the whole array, passing the tail through it
+         * zero padded, so every sample takes the same path whichever way a
+         * render is split into blocks.
+         */
+        static void runPadded(VectorKernel kernel, const float *a, const float *b, float *out, size_t count)
+        {
+            size_t i = kernel(a, b, out, count);
+            if (i < count) {
+                float padA[MAX_LANES] = {0}, padB[MAX_LANES] = {0}, padOut[MAX_LANES];
+                std::copy(a + i, a + count, padA);
+                std::copy(b + i, b + count, padB);
+                kernel(padA, padB, padOut, MAX_LANES);
+                std::copy(padOut, padOut + (count - i), out + i);
+            }
+        }
+
+#endif
+
+        void sinSaw(const float *phase, const float *param, float *out, size_t count)
+        {
+#ifdef KERNELS_X86
+            if (currentIsa == AVX2) {
+                runPadded(sinSawAvx2, phase, param, out, count);
+                return;
+            }
+            if (currentIsa == SSE2) {
+                runPadded(sinSawSse2, phase, param, out, count);
+                return;
+            }
+#endif
+            for (size_t i = 0; i < count; i++) {
+                out[i] = Synth::sinSaw(phase[i], param[i], 0);
+            }
+        }
+
+        void resonantSaw(const float *phase, const float *param, float *out, size_t count)
+        {
+#ifdef KERNELS_X86
+            if (currentIsa == AVX2) {
+                runPadded(resonantSawAvx2, phase, param, out, count);
+                return;
+            }
+            if (currentIsa == SSE2) {
+                runPadded(resonantSawSse2, phase, param, out, count);
+                return;
+            }
+#endif
+            for (size_t i = 0; i < count; i++) {
+                out[i] = Synth::resonantSaw(phase[i], param[i], 0);
+            }
+        }
+
+        float noiseAt(uint32_t seed, uint64_t counter)
+        {
+            return (pcgHash((uint32_t)counter ^ noiseKey(seed, counter)) >> 8) * NOISE_SCALE;
+        }
+
+        void noise(const float *param, const float *amplitude, uint32_t seed, uint64_t counter,
+            float& previous, float *out, size_t count)
+        {
+            float draws[NOISE_CHUNK];
+            float last = previous;
+            for (size_t i = 0; i < count;) {
+                uint32_t first = counter + i;
+                uint32_t key = noiseKey(seed, counter + i);
+                // Stop where the high word of the counter, and so the key, changes
+                size_t piece = std::min<uint64_t>(std::min(count - i, NOISE_CHUNK), ((uint64_t)1 << 32) - first);
+                size_t j = 0;
+#ifdef KERNELS_X86
+                if (currentIsa == AVX2) {
+                    j = noiseAvx2(key, first, draws, piece);
+                }
+#endif
+                for (; j < piece; j++) {
+                    draws[j] = (pcgHash((first + j) ^ key) >> 8) * NOISE_SCALE;
+                }
+                // Each sample filters the last one, so this part stays a scalar loop
+                for (j = 0; j < piece; j++, i++) {
+                    last = (last + (draws[j] - last) * param[i]) * amplitude[i];
+                    out[i] = last;
+                }
+            }
+            previous = last;
+        }
+
+        void multiply(float *dst, const float *src, size_t count)
+        {
+            size_t i = 0;
+#ifdef KERNELS_X86
+            if (currentIsa == AVX2) {
+                i = multiplyAvx2(dst, src, count);
+            }
+            else if (currentIsa == SSE2) {
+                i = multiplySse2(dst, src, count);
+            }
+#endif
+            for (; i < count; i++) {
+                dst[i] *= src[i];
+            }
+        }
+
+        void accumulate(float *dst, const float *src, float scale, size_t count)
+        {
+            size_t i = 0;
+#ifdef KERNELS_X86
+            if (currentIsa == AVX2) {
+                i = accumulateAvx2(dst, src, scale, count);
+            }
+            else if (currentIsa == SSE2) {
+                i = accumulateSse2(dst, src, scale, count);
+            }
+#endif
+            for (; i < count; i++) {
+                dst[i] += src[i] * scale;
+            }
+        }
+
+        void toPcm(int32_t *dst, const float *src, float scale, size_t count)
+        {
+            // 32-bit PCM would otherwise clamp to 2^31, one past what fits
+            float limit = std::min(scale, 2147483520.0f);
+            size_t i = 0;
+#ifdef KERNELS_X86
+            if (currentIsa == AVX2) {
+                i = toPcmAvx2(dst, src, scale, limit, count);
+            }
+            else if (currentIsa == SSE2) {
+                i = toPcmSse2(dst, src, scale, limit, count);
+            }
+#endif
+            for (; i < count; i++) {
+                dst[i] = std::min(limit, std::max(-limit, src[i] * scale)); // NaN clamps low, as in the vector paths
+            }
+        }
+
+    }
+
+}
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mappedfile.hpp"
+
+namespace Synth {
+    
+    MappedFile::~MappedFile()
+    {
+        close();
+    }
+    
+#ifdef _WIN32
+    bool MappedFile::open(const std::string& path)
+    {
+        close();
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            std::cerr << "Couldn't open " << path << "\n";
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        HANDLE mapping = nullptr;
+        if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        }
+        CloseHandle(file); // The mapping keeps the file open
+        const void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (!view) {
+            std::cerr << "Couldn't map " << path << "\n";
+            if (mapping) {
+                CloseHandle(mapping);
+            }
+            return false;
+        }
+        bytes = static_cast<const uint8_t*>(view);
+        length = fileSize.QuadPart;
+        handle = mapping;
+        return true;
+    }
+    
+    void MappedFile::close()
+    {
+        if (bytes) {
+            UnmapViewOfFile(bytes);
+            CloseHandle(handle);
+        }
+        bytes = nullptr;
+        length = 0;
+        handle = nullptr;
+    }
+#else
+    bool MappedFile::open(const std::string& path)
+    {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Couldn't open " << path << "\n";
+            return false;
+        }
+        struct stat info;
+        void *view = MAP_FAILED;
+        if (!fstat(fd, &info) && info.st_size > 0) {
+            view = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd); // The mapping keeps the file open
+        if (view == MAP_FAILED) {
+            std::cerr << "Couldn't map " << path << "\n";
+            return false;
+        }
+        madvise(view, info.st_size, MADV_SEQUENTIAL);
+        bytes = static_cast<const uint8_t*>(view);
+        length = info.st_size;
+        return true;
+    }
+    
+    void MappedFile::close()
+    {
+        if (bytes) {
+            munmap(const_cast<uint8_t*>(bytes), length);
+        }
+        bytes = nullptr;
+        length = 0;
+    }
+#endif
+    
+}
\ No newline at end of file
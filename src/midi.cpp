@@ -2,11 +2,13 @@
 #include <cstdint>
 #include <cstring>
 #include <cmath>
+#include <cstdlib>
 #include <istream>
 #include <iterator>
 #include <iostream>
 #include <ios>
 #include <fstream>
+#include <functional>
 #include <limits>
 #include <set>
 
@@ -27,43 +29,83 @@ namespace Midi {
         return units / framesPerSecond * Synth::SEC_TO_MSEC;
     }
     
-    const static size_t MTHD_LENGTH = 6;
+    const static double SMPTE_DROP_FPS = 29.97;
     
-    static uint32_t betoh32(std::uint8_t *buff)
+    TempoMap::TempoMap(const MidiHeader& header) :
+        header {header},
+        segments {{0, 0, tickLength(DEFAULT_TEMPO)}}
+    {}
+    
+    double TempoMap::tickLength(uint32_t usecPerQNote) const
+    {
+        if (!header.ticksPerUnit) {
+            return 0;
+        }
+        if (header.unit == QNOTE) {
+            return usecPerQNote * 1e-6 / header.ticksPerUnit;
+        }
+        // readHeader gives the frame rate as a positive count
+        double framesPerSecond = std::abs(header.unit) == -DRP30 ? SMPTE_DROP_FPS : std::abs(header.unit);
+        return 1 / (framesPerSecond * header.ticksPerUnit);
+    }
+    
+    void TempoMap::change(uint64_t tick, uint32_t usecPerQNote)
+    {
+        if (header.unit != QNOTE) {
+            return;
+        }
+        Segment last = segments.back();
+        Segment next {tick, last.seconds + (tick - last.tick) * last.secondsPerTick, tickLength(usecPerQNote)};
+        if (tick == last.tick) {
+            segments.back() = next;
+        }
+        else {
+            segments.push_back(next);
+        }
+    }
+    
+    double TempoMap::seconds(uint64_t tick) const
+    {
+        auto after = std::upper_bound(segments.begin(), segments.end(), tick,
+            [](uint64_t tick, const Segment& segment) {return tick < segment.tick;});
+        const Segment& segment = *(after - 1);
+        return segment.seconds + (tick - segment.tick) * segment.secondsPerTick;
+    }
+    
+    const static size_t MTHD_LENGTH = 6,
+        CHUNK_HEADER = 8, // Type and length
+        MAX_VAR_LENGTH = 4,
+        TRACK_READ = 1 << 16; // Bytes of a track chunk read from a stream at a time
+    
+    static uint32_t betoh32(const std::uint8_t *buff)
     {
         return buff[3] | (buff[2] << 8) | (buff[1] << 16) | (buff[0] << 24);
     }
     
-    static uint32_t betoh16(std::uint8_t *buff)
+    static uint32_t betoh16(const std::uint8_t *buff)
     {
         return buff[1] | (buff[0] << 8);
     }
     
-    bool readHeader(std::istream& stream, MidiHeader& header)
+    static bool parseHeader(const uint8_t *buff, size_t size, MidiHeader& header)
     {
-        char buff[5];
-        buff[4] = 0;
-        stream.read(buff, 4);
-        if (strncmp(buff, "MThd", 4)) {
+        if (size < CHUNK_HEADER || strncmp(reinterpret_cast<const char*>(buff), "MThd", 4)) {
             std::cerr << "MThd chunk not found, instead got";
-            for (size_t i = 0; i < 4; i++) {
+            for (size_t i = 0; i < std::min<size_t>(size, 4); i++) {
                 std::cerr << (int)buff[i] << ", ";
             }
             std::cerr << "\n";
             return false;
         }
-        stream.read(buff, 4);
-        uint32_t length = betoh32(reinterpret_cast<uint8_t*>(buff));
-        if (length != MTHD_LENGTH) {
+        uint32_t length = betoh32(buff + 4);
+        if (length != MTHD_LENGTH || size < CHUNK_HEADER + MTHD_LENGTH) {
             std::cerr << "Invalid length of MThd chunk\n";
             return false;
         }
-        stream.read(buff, 2);
-        header.format = betoh16(reinterpret_cast<uint8_t*>(buff));
-        stream.read(buff, 2);
-        header.ntrks = betoh16(reinterpret_cast<uint8_t*>(buff));
-        stream.read(buff, 2);
-        uint16_t div = betoh16(reinterpret_cast<uint8_t*>(buff));
+        buff += CHUNK_HEADER;
+        header.format = betoh16(buff);
+        header.ntrks = betoh16(buff + 2);
+        uint16_t div = betoh16(buff + 4);
         if (div & 0x8000) { // SMPTE
             header.unit = (((~div) >> 8) + 1) & 0x3f;
             header.ticksPerUnit = div & 0xff;
@@ -75,83 +117,134 @@ namespace Midi {
         return true;
     }
     
-    uint32_t readVarLength(std::istream& stream, size_t& numOut)
+    bool readHeader(std::istream& stream, MidiHeader& header)
+    {
+        uint8_t buff[CHUNK_HEADER + MTHD_LENGTH];
+        stream.read(reinterpret_cast<char*>(buff), sizeof(buff));
+        return parseHeader(buff, stream.gcount(), header);
+    }
+    
+    bool MidiParser::readHeader(MidiHeader& header)
+    {
+        if (!parseHeader(data + position, size - position, header)) {
+            return false;
+        }
+        position += CHUNK_HEADER + MTHD_LENGTH;
+        return true;
+    }
+    
+    bool MidiParser::nextTrack(TrackReader& reader)
+    {
+        while (size - position >= CHUNK_HEADER) {
+            const uint8_t *chunk = data + position;
+            uint32_t length = betoh32(chunk + 4);
+            if (length > size - position - CHUNK_HEADER) {
+                std::cerr << "Chunk runs past the end of the file\n";
+                return false;
+            }
+            position += CHUNK_HEADER + length;
+            if (!strncmp(reinterpret_cast<const char*>(chunk), "MTrk", 4)) {
+                reader = TrackReader(data, chunk + CHUNK_HEADER, length);
+                return true;
+            }
+        }
+        std::cerr << "MTrk chunk not found\n";
+        return false;
+    }
+    
+    // Reads a variable-length quantity of at most four bytes, advancing cursor past it
+    static bool readVarLength(const uint8_t *&cursor, const uint8_t *end, uint32_t& value)
     {
-        size_t num = 0;
-        uint32_t i = 0;
-        while (true) {
-            uint8_t byte = stream.get();
-            num++;
-            i = (i << 7) | (byte & 0x7f);
+        value = 0;
+        for (size_t i = 0; i < MAX_VAR_LENGTH && cursor < end; i++) {
+            uint8_t byte = *cursor++;
+            value = (value << 7) | (byte & 0x7f);
             if (!(byte & 0x80)) {
-                numOut = num;
-                return i;
+                return true;
             }
         }
+        return false;
     }
     
-    bool readTrack(std::istream& stream, std::vector<MidiMessage>& track)
+    bool TrackReader::next(MidiEvent& event)
     {
-        char buff[4];
-        stream.read(buff, 4);
-        if (strncmp(buff, "MTrk", 4)) {
-            std::cerr << "MTrk chunk not found\n";
+        if (cursor == end || failed) {
             return false;
         }
-        stream.read(buff, 4);
-        int32_t length = betoh32(reinterpret_cast<uint8_t*>(buff));
-        size_t bytesRead;
-        uint16_t running;
-        uint32_t deltaTime = 0;
-        while (length > 0) {
-            if (stream.eof()) {
-                std::cerr << "Stream ran out before finished reading track\n";
-                return false;
-            }
-            std::vector<uint8_t> extraBytes;
-            deltaTime += readVarLength(stream, bytesRead);
-            length -= bytesRead;
-            size_t numExtraBytes;
-            uint16_t status = stream.get();
-            length --;
-            if (status == 0xFF) { // Meta event
-                status = 0xFF00 | stream.get();
-                length --;
-                numExtraBytes = readVarLength(stream, bytesRead);
-                length -= bytesRead;
+        uint32_t size = 0;
+        bool ok = readVarLength(cursor, end, event.deltaTime) && cursor < end;
+        uint16_t status = ok ? *cursor : 0;
+        if (status == 0xFF) { // Meta event
+            ok = ++cursor < end;
+            status = ok ? 0xFF00 | *cursor++ : 0;
+            ok = ok && readVarLength(cursor, end, size);
+        }
+        else if (status == 0xF0 || status == 0xF7) { // Sysex
+            cursor++;
+            ok = readVarLength(cursor, end, size);
+        }
+        else if (ok) {
+            size = 2;
+            if (status & 0x80) {
+                running = status;
+                cursor++;
             }
-            else {
-                numExtraBytes = 2;
-                if (!(status & 0x80)) { // Running status
-                    extraBytes.push_back(status);
-                    status = running;
-                }
-                else {
-                    running = status;
-                    if ((status & 0xF0) == PROGRAM || (status & 0xF0) == CHANNEL_PRESSURE) {
-                        numExtraBytes = 1;
-                    }
-                }
+            else { // Running status
+                status = running;
+                ok = running;
             }
-            while (extraBytes.size() < numExtraBytes) {
-                extraBytes.push_back(stream.get());
-                length --;
+            if ((status & 0xF0) == PROGRAM || (status & 0xF0) == CHANNEL_PRESSURE) {
+                size = 1;
             }
+        }
+        if (!ok || size > (size_t)(end - cursor)) {
+            std::cerr << "Track ran out or is malformed with " << end - cursor << " bytes left\n";
+            failed = true;
+            return false;
+        }
+        event.msgType = status;
+        event.length = std::min<uint32_t>(size, sizeof(event.data));
+        std::copy(cursor, cursor + event.length, event.data);
+        bool channel = status < 0xF0;
+        event.offset = channel ? 0 : cursor - base;
+        event.size = channel ? 0 : size;
+        cursor += size;
+        return true;
+    }
+    
+    bool readMessage(TrackReader& reader, MidiMessage& msg)
+    {
+        MidiEvent event;
+        uint32_t deltaTime = 0;
+        while (reader.next(event)) {
+            deltaTime += event.deltaTime;
+            uint16_t status = event.msgType;
             if (
                 (status & 0xF0) == PROGRAM ||
                 (status & 0xF0) == NOTE_OFF ||
                 (status & 0xF0) == NOTE_ON ||
                 status == END_OF_TRACK ||
                 status == TEMPO ) {
-                    MidiMessage msg {deltaTime, status, extraBytes};
-                    deltaTime = 0;
-                    track.push_back(msg);
+                    msg = MidiMessage(deltaTime, status, event.data, event.length);
+                    return true;
             }
-            if (status == END_OF_TRACK && length) {
-                std::cerr << "Premature end of track message with " << length << " bytes left\n";
+        }
+        return false;
+    }
+    
+    bool readTrack(TrackReader& reader, std::vector<MidiMessage>& track)
+    {
+        MidiMessage msg {0, 0};
+        while (readMessage(reader, msg)) {
+            track.push_back(msg);
+            if (msg.msgType == END_OF_TRACK && reader.remaining()) {
+                std::cerr << "Premature end of track message with " << reader.remaining() << " bytes left\n";
                 return false;
             }
         }
+        if (!reader.good()) {
+            return false;
+        }
         if (track.empty() || track.back().msgType != END_OF_TRACK) {
             std::cerr << "Missing end of track message\n";
             return false;
@@ -159,48 +252,157 @@ namespace Midi {
         return true;
     }
     
+    bool readTrack(std::istream& stream, std::vector<MidiMessage>& track)
+    {
+        uint8_t head[CHUNK_HEADER];
+        stream.read(reinterpret_cast<char*>(head), CHUNK_HEADER);
+        if (stream.gcount() != CHUNK_HEADER || strncmp(reinterpret_cast<char*>(head), "MTrk", 4)) {
+            std::cerr << "MTrk chunk not found\n";
+            return false;
+        }
+        uint32_t length = betoh32(head + 4);
+        // Grow with what the stream holds rather than trust the length, which may be corrupt
+        std::vector<uint8_t> chunk;
+        while (chunk.size() < length && stream) {
+            size_t read = chunk.size();
+            chunk.resize(read + std::min<size_t>(length - read, TRACK_READ));
+            stream.read(reinterpret_cast<char*>(chunk.data() + read), chunk.size() - read);
+            chunk.resize(read + stream.gcount());
+        }
+        if (chunk.size() != length) {
+            std::cerr << "Stream ran out before finished reading track\n";
+            return false;
+        }
+        TrackReader reader(chunk.data(), chunk.data(), length);
+        return readTrack(reader, track);
+    }
+    
+    EventStream::EventStream(const std::vector<std::vector<MidiMessage>>& tracks) :
+        tracks {&tracks},
+        time {0}
+    {
+        start(tracks.size());
+    }
+    
+    EventStream::EventStream(const std::vector<TrackReader>& readers) :
+        tracks {nullptr},
+        readers {readers},
+        time {0}
+    {
+        start(readers.size());
+    }
+    
+    void EventStream::start(size_t count)
+    {
+        indices.assign(count, 0);
+        pending.assign(count, {0, 0});
+        heap.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            if (load(i)) {
+                heap.push_back({pending[i].deltaTime, i});
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), std::greater<Cursor>());
+    }
+    
+    bool EventStream::load(size_t track)
+    {
+        if (!tracks) {
+            return readMessage(readers[track], pending[track]);
+        }
+        if (indices[track] == (*tracks)[track].size()) {
+            return false;
+        }
+        pending[track] = (*tracks)[track][indices[track]++];
+        return true;
+    }
+    
+    bool EventStream::next(MidiMessage& msg)
+    {
+        if (heap.empty()) {
+            return false;
+        }
+        std::pop_heap(heap.begin(), heap.end(), std::greater<Cursor>());
+        Cursor& cursor = heap.back();
+        msg = pending[cursor.track];
+        msg.deltaTime = cursor.time - time;
+        time = cursor.time;
+        if (load(cursor.track)) {
+            cursor.time += pending[cursor.track].deltaTime;
+            std::push_heap(heap.begin(), heap.end(), std::greater<Cursor>());
+        }
+        else {
+            heap.pop_back();
+        }
+        return true;
+    }
+    
+    bool EventStream::good() const
+    {
+        for (const auto& reader : readers) {
+            if (!reader.good()) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
     std::vector<MidiMessage> joinTracks(const std::vector<std::vector<MidiMessage>>& tracks)
     {
-        size_t ntrks = tracks.size();
+        size_t total = 0;
+        for (const auto& track : tracks) {
+            total += track.size();
+        }
         std::vector<MidiMessage> joined;
-        std::vector<uint32_t> times(ntrks, 0);
-        std::vector<size_t> indices(ntrks, 0);
-        uint32_t time = 0;
-        for (size_t i = 0; i < ntrks; i++) {
-            times[ntrks] = tracks[i][0].deltaTime;
-        }
-        size_t trackNo;
-        while (true) {
-            auto least = std::min_element(times.begin(), times.end());
-            trackNo = std::distance(times.begin(), least);
-            if (indices[trackNo] == tracks[trackNo].size()) {
-                break;
-            }
-            MidiMessage msg (tracks[trackNo][indices[trackNo]]);
-            times[trackNo] += msg.deltaTime;
-            msg.deltaTime = times[trackNo] - time;
-            time = times[trackNo];
-            indices[trackNo]++;
+        joined.reserve(total);
+        EventStream stream(tracks);
+        MidiMessage msg {0, 0};
+        while (stream.next(msg)) {
             joined.push_back(msg);
         }
         return joined;
     }
     
-    int maxPolyphony(const std::vector<MidiMessage>& msgs)
-    {
-        std::set<std::pair<int, int>> notes;
-        int polyphony = 1;
-        for (auto msg : msgs) {
-            if ((msg.msgType & 0xF0) == NOTE_ON) {
-                notes.insert({msg.msgType & 0xF, msg.data[0]});
+    // Tracks the notes held at once as the messages go by in order
+    class NoteCounter {
+        private:
+            std::set<std::pair<int, int>> notes;
+            int polyphony = 1;
+        public:
+            void add(const MidiMessage& msg)
+            {
+                if ((msg.msgType & 0xF0) == NOTE_ON) {
+                    notes.insert({msg.msgType & 0xF, msg.data[0]});
+                }
+                else if ((msg.msgType & 0xF0) == NOTE_OFF) {
+                    notes.erase({msg.msgType & 0xF, msg.data[0]});
+                }
+                polyphony = std::max(polyphony, (int)notes.size());
             }
-            else if ((msg.msgType & 0xF0) == NOTE_OFF) {
-                notes.erase({msg.msgType & 0xF, msg.data[0]});
+            int peak() const
+            {
+                std::cerr << "Max polyphony = " << polyphony << "\n";
+                return polyphony;
             }
-            polyphony = std::max(polyphony, (int)notes.size());
+    };
+    
+    int maxPolyphony(const std::vector<MidiMessage>& msgs)
+    {
+        NoteCounter counter;
+        for (const auto& msg : msgs) {
+            counter.add(msg);
+        }
+        return counter.peak();
+    }
+    
+    int maxPolyphony(EventStream& stream)
+    {
+        NoteCounter counter;
+        MidiMessage msg {0, 0};
+        while (stream.next(msg)) {
+            counter.add(msg);
         }
-        std::cerr << "Max polyphony = " << polyphony << "\n";
-        return polyphony;
+        return counter.peak();
     }
     
     const static float A4_FREQUENCY = 440.0,
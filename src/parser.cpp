@@ -5,13 +5,15 @@
 #include <vector>
 
 #include "synthutil.hpp"
+#include "wavetable.hpp"
 
 namespace Synth {
     
     static void skipWhitespace(std::istream& stream)
     {
         while (!stream.eof()) {
-            if (!isspace(stream.get())) {
+            int next = stream.get();
+            if (next != EOF && !isspace(next)) { // Ungetting EOF would clear eof and loop forever
                 stream.unget();
                 return;
             }
@@ -75,7 +77,7 @@ namespace Synth {
     
     std::ostream& operator<<(std::ostream& stream, const Envelope& obj)
     {
-        for (auto it : obj.envelope) {
+        for (const auto& it : obj.envelope) {
             stream << it.first << "," << it.second << " : ";
         }
         stream << " SUS " << obj.sustainId << "\n";
@@ -93,14 +95,10 @@ namespace Synth {
         }
         int funcId = 0;
         stream >> funcId;
-        floatfunc funcs[5] = {
-            sine,
-            sawUp,
-            sawDown,
-            triangle,
-            zero
-        };
-        lfo.shape = funcs[funcId];
+        if (funcId < 0 || funcId >= (int)NUM_LFO_SHAPES) {
+            throw "Unknown LFO shape";
+        }
+        lfo.shape = LFO_SHAPES[funcId];
         if (!stream.eof() && getDelim(stream) == '!') {
             return lfo;
         }
@@ -145,10 +143,15 @@ namespace Synth {
                     synth.tremelo = LFO::read(stream);
                     break;
                 case 'F': {
-                    int funcId;
+                    int funcId = -1;
                     stream >> funcId;
-                    resfunc funcs[3] = {sinSaw, resonantSaw, noise};
-                    synth.shape = funcs[funcId];
+                    if (funcId < 0 || funcId >= (int)NUM_SYNTH_SHAPES) {
+                        throw "Unknown synth shape";
+                    }
+                    synth.shape = SYNTH_SHAPES[funcId];
+                    if (synth.shape == wavetable) {
+                        Wavetable::bank(); // Build the tables at load rather than on the first note
+                    }
                     getDelim(stream);
                     break;
                 }
@@ -184,7 +187,7 @@ namespace Synth {
     std::ostream& operator<<(std::ostream& stream, const Patch& obj)
     {
         stream << "{#" << obj.synths.size() << "\n";
-        for (auto it : obj.synths) {
+        for (const auto& it : obj.synths) {
             stream << it;
         }
         stream << "}\n";
@@ -203,7 +206,7 @@ namespace Synth {
                 patches.push_back(Patch::read(stream));
             }
             return patches;
-        } catch (const std::string& error) {
+        } catch (const char *error) {
             std::cerr << "Error reading patches: " << error << "\n";
             if (patches.empty()) {
                 patches.push_back(Patch());
@@ -0,0 +1,400 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <istream>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mappedfile.hpp"
+#include "patchbank.hpp"
+#include "synthutil.hpp"
+#include "wavetable.hpp"
+
+namespace Synth {
+    
+    const static char BANK_MAGIC[] = "SPBK";
+    const static size_t BANK_HEADER = 12, // Magic, version, reserved, count
+        SYNTH_PADDING = 3;
+    
+    static void putU32(std::vector<uint8_t>& out, uint32_t value)
+    {
+        for (size_t i = 0; i < 4; i++) {
+            out.push_back(value >> (8 * i));
+        }
+    }
+    
+    static void putF32(std::vector<uint8_t>& out, float value)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        putU32(out, bits);
+    }
+    
+    template <class T>
+    static uint32_t indexOf(const T *table, size_t size, T value)
+    {
+        for (size_t i = 0; i < size; i++) {
+            if (table[i] == value) {
+                return i;
+            }
+        }
+        return 0;
+    }
+    
+    // Bounds-checked reads over the bank, which fail for good once any runs past the end
+    class BankCursor {
+        private:
+            const uint8_t *cursor;
+            const uint8_t *end;
+            bool failed;
+        public:
+            BankCursor(const uint8_t *begin, const uint8_t *end) :
+                cursor {begin}, end {end}, failed {false} {}
+            
+            inline bool good() const
+            {
+                return !failed;
+            }
+            inline bool fail()
+            {
+                failed = true;
+                return false;
+            }
+            bool skip(size_t count)
+            {
+                if (failed || (size_t)(end - cursor) < count) {
+                    return fail();
+                }
+                cursor += count;
+                return true;
+            }
+            uint32_t u32()
+            {
+                const uint8_t *at = cursor;
+                if (!skip(4)) {
+                    return 0;
+                }
+                return at[0] | (at[1] << 8) | (at[2] << 16) | ((uint32_t)at[3] << 24);
+            }
+            uint8_t u8()
+            {
+                const uint8_t *at = cursor;
+                return skip(1) ? *at : 0;
+            }
+            float f32()
+            {
+                uint32_t bits = u32();
+                float value;
+                std::memcpy(&value, &bits, sizeof(value));
+                return value;
+            }
+            Envelope envelope()
+            {
+                uint32_t count = u32();
+                uint32_t sustain = u32();
+                if (!count || sustain >= count || (size_t)(end - cursor) / 8 < count) {
+                    fail();
+                    return {};
+                }
+                std::vector<std::pair<float, float>> points(count);
+                for (auto& point : points) {
+                    point.first = f32();
+                    point.second = f32();
+                }
+                return {points, sustain};
+            }
+            LFO lfo()
+            {
+                float frequency = f32();
+                float depth = f32();
+                float offset = f32();
+                float dc = f32();
+                uint32_t shape = u32();
+                if (shape >= NUM_LFO_SHAPES) {
+                    fail();
+                    return {};
+                }
+                return {frequency, depth, LFO_SHAPES[shape], offset, dc};
+            }
+            Synth synth()
+            {
+                uint8_t shape = u8();
+                skip(SYNTH_PADDING);
+                if (shape >= NUM_SYNTH_SHAPES) {
+                    fail();
+                    return {};
+                }
+                Envelope dca = envelope();
+                Envelope dcw = envelope();
+                Envelope dco = envelope();
+                LFO vibrato = lfo();
+                LFO tremelo = lfo();
+                return {SYNTH_SHAPES[shape], dca, dcw, dco, vibrato, tremelo};
+            }
+    };
+    
+    void PatchBank::write(std::vector<uint8_t>& out, const Envelope& envelope)
+    {
+        putU32(out, envelope.envelope.size());
+        putU32(out, envelope.sustainId);
+        for (const auto& point : envelope.envelope) {
+            putF32(out, point.first);
+            putF32(out, point.second);
+        }
+    }
+    
+    void PatchBank::write(std::vector<uint8_t>& out, const LFO& lfo)
+    {
+        putF32(out, lfo.frequency);
+        putF32(out, lfo.depth);
+        putF32(out, lfo.offset);
+        putF32(out, lfo.dc);
+        putU32(out, indexOf(LFO_SHAPES, NUM_LFO_SHAPES, lfo.shape));
+    }
+    
+    void PatchBank::write(std::vector<uint8_t>& out, const Synth& synth)
+    {
+        out.push_back(indexOf(SYNTH_SHAPES, NUM_SYNTH_SHAPES, synth.shape));
+        out.insert(out.end(), SYNTH_PADDING, 0);
+        write(out, synth.dca);
+        write(out, synth.dcw);
+        write(out, synth.dco);
+        write(out, synth.vibrato);
+        write(out, synth.tremelo);
+    }
+    
+    std::vector<uint8_t> PatchBank::write(const std::vector<Patch>& patches)
+    {
+        std::vector<uint8_t> out(BANK_MAGIC, BANK_MAGIC + 4);
+        out.push_back(VERSION & 0xFF);
+        out.push_back(VERSION >> 8);
+        out.insert(out.end(), 2, 0);
+        putU32(out, patches.size());
+        size_t index = out.size();
+        out.resize(index + 4 * patches.size());
+        for (size_t p = 0; p < patches.size(); p++) {
+            std::vector<uint8_t> offset;
+            putU32(offset, out.size());
+            std::copy(offset.begin(), offset.end(), out.begin() + index + 4 * p);
+            putU32(out, patches[p].synths.size());
+            for (const auto& synth : patches[p].synths) {
+                write(out, synth);
+            }
+        }
+        return out;
+    }
+    
+    bool PatchBank::write(std::ostream& stream, const std::vector<Patch>& patches)
+    {
+        std::vector<uint8_t> bank = write(patches);
+        stream.write(reinterpret_cast<const char*>(bank.data()), bank.size());
+        return stream.good();
+    }
+    
+    bool PatchBank::read(const uint8_t *data, size_t size, std::vector<Patch>& patches)
+    {
+        if (size < BANK_HEADER || std::memcmp(data, BANK_MAGIC, 4)) {
+            std::cerr << "Not a patch bank\n";
+            return false;
+        }
+        uint16_t version = data[4] | (data[5] << 8);
+        if (version != VERSION) {
+            std::cerr << "Unsupported patch bank version " << version << "\n";
+            return false;
+        }
+        BankCursor header(data + 8, data + size);
+        uint32_t count = header.u32();
+        size_t first = patches.size();
+        patches.reserve(first + std::min<size_t>(count, size / 4));
+        for (uint32_t p = 0; p < count && header.good(); p++) {
+            uint32_t offset = header.u32();
+            BankCursor cursor(data + std::min<size_t>(offset, size), data + size);
+            uint32_t synthCount = cursor.u32();
+            std::vector<Synth> synths;
+            for (uint32_t s = 0; s < synthCount && cursor.good(); s++) {
+                synths.push_back(cursor.synth());
+                if (synths.back().shape == Synth::wavetable) {
+                    Wavetable::bank(); // Build the tables at load rather than on the first note
+                }
+            }
+            if (!cursor.good() || synths.empty()) {
+                std::cerr << "Patch " << p << " of the bank is malformed\n";
+                patches.resize(first);
+                return false;
+            }
+            patches.emplace_back(synths);
+        }
+        if (!header.good()) {
+            std::cerr << "Patch bank index runs past the end\n";
+            patches.resize(first);
+            return false;
+        }
+        return true;
+    }
+    
+    bool PatchBank::read(const std::string& path, std::vector<Patch>& patches)
+    {
+        MappedFile file;
+        return file.open(path) && read(file.data(), file.size(), patches);
+    }
+    
+    /*
+     * Text patches up to the closing '!'. Unlike readPatches, which stands a
+     * default patch in for one it can't parse, throws the parser's error.
+     */
+    static std::vector<Patch> readText(std::istream& text)
+    {
+        std::vector<Patch> patches;
+        while (!(text >> std::ws).eof() && text.peek() != '!') {
+            patches.push_back(Patch::read(text));
+        }
+        if (text.eof()) {
+            throw "Patches end without the closing '!', so may be cut short";
+        }
+        return patches;
+    }
+    
+    bool PatchBank::convert(std::istream& text, std::ostream& bank)
+    {
+        std::vector<Patch> patches;
+        try {
+            patches = readText(text);
+        } catch (const char *error) {
+            std::cerr << "Error reading patches: " << error << "\n";
+            return false;
+        }
+        if (patches.empty()) {
+            std::cerr << "No patches to convert\n";
+            return false;
+        }
+        return write(bank, patches);
+    }
+    
+    typedef std::pair<uint64_t, size_t> BankKey; // Content hash and length
+    
+    struct BankEntry {
+        public:
+            std::vector<uint8_t> bytes; // The contents, to tell apart any that hash alike
+            std::shared_future<SharedPatches> patches;
+            uint64_t load; // Which load made it, so a failed one drops only its own entry
+    };
+    
+    struct BankCache {
+        public:
+            std::mutex lock;
+            std::map<BankKey, BankEntry> banks;
+            uint64_t loads = 0;
+    };
+    
+    static BankCache& bankCache()
+    {
+        static BankCache cache;
+        return cache;
+    }
+    
+    // 64-bit FNV-1a
+    static uint64_t hashBytes(const uint8_t *data, size_t size)
+    {
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ data[i]) * 0x100000001B3ULL;
+        }
+        return hash;
+    }
+    
+    static SharedPatches parseBank(const uint8_t *data, size_t size)
+    {
+        auto patches = std::make_shared<std::vector<Patch>>();
+        if (size >= 4 && !std::memcmp(data, BANK_MAGIC, 4)) {
+            if (!PatchBank::read(data, size, *patches)) {
+                return nullptr;
+            }
+        } else {
+            std::istringstream text(std::string(reinterpret_cast<const char*>(data), size));
+            *patches = readText(text);
+        }
+        return patches;
+    }
+    
+    // Lets a later load retry, unless a clear() has already let another take the key
+    static void dropEntry(BankCache& cache, const BankKey& key, uint64_t load)
+    {
+        std::lock_guard<std::mutex> guard(cache.lock);
+        auto found = cache.banks.find(key);
+        if (found != cache.banks.end() && found->second.load == load) {
+            cache.banks.erase(found);
+        }
+    }
+    
+    SharedPatches PatchCache::load(const std::string& path)
+    {
+        MappedFile file;
+        return file.open(path) ? load(file.data(), file.size()) : nullptr;
+    }
+    
+    SharedPatches PatchCache::load(const uint8_t *data, size_t size)
+    {
+        BankKey key {hashBytes(data, size), size};
+        BankCache& cache = bankCache();
+        std::promise<SharedPatches> loaded;
+        std::shared_future<SharedPatches> pending;
+        uint64_t load = 0; // Nonzero if this call parses for the cache
+        {
+            std::lock_guard<std::mutex> guard(cache.lock);
+            auto found = cache.banks.find(key);
+            if (found == cache.banks.end()) {
+                load = ++cache.loads;
+                BankEntry entry {std::vector<uint8_t>(data, data + size), loaded.get_future().share(), load};
+                found = cache.banks.emplace(key, std::move(entry)).first;
+            }
+            if (std::equal(data, data + size, found->second.bytes.begin())) {
+                pending = found->second.patches;
+            }
+        }
+        if (!pending.valid()) {
+            return parseBank(data, size); // Collides with what the cache holds, so goes uncached
+        }
+        if (!load) {
+            return pending.get(); // Waits out another thread's parse, throwing what it threw
+        }
+        // Parse outside the lock so other contents load alongside
+        SharedPatches patches;
+        try {
+            patches = parseBank(data, size);
+        }
+        catch (...) {
+            dropEntry(cache, key, load);
+            loaded.set_exception(std::current_exception()); // Waiting loads see the same failure
+            throw;
+        }
+        if (!patches) {
+            dropEntry(cache, key, load);
+        }
+        loaded.set_value(patches);
+        return patches;
+    }
+    
+    size_t PatchCache::size()
+    {
+        BankCache& cache = bankCache();
+        std::lock_guard<std::mutex> guard(cache.lock);
+        return cache.banks.size();
+    }
+    
+    void PatchCache::clear()
+    {
+        BankCache& cache = bankCache();
+        std::lock_guard<std::mutex> guard(cache.lock);
+        cache.banks.clear();
+    }
+    
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "kernels.hpp"
+#include "pcmring.hpp"
+
+namespace Synth {
+    
+    static size_t roundUp(size_t n)
+    {
+        size_t size = 1;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+    
+    PcmRing::PcmRing(size_t capacity) :
+        ring (roundUp(capacity)),
+        mask {ring.size() - 1},
+        head {0},
+        tail {0}
+    {}
+    
+    void PcmRing::grow(size_t count)
+    {
+        std::vector<int32_t> larger(roundUp(size() + count));
+        size_t first = head & mask;
+        size_t wrapped = std::min(size(), ring.size() - first);
+        std::copy(ring.begin() + first, ring.begin() + first + wrapped, larger.begin());
+        std::copy(ring.begin(), ring.begin() + (size() - wrapped), larger.begin() + wrapped);
+        tail = size();
+        head = 0;
+        ring.swap(larger);
+        mask = ring.size() - 1;
+    }
+    
+    void PcmRing::write(const float *samples, float scale, size_t count)
+    {
+        if (size() + count > ring.size()) {
+            grow(count);
+        }
+        size_t first = tail & mask;
+        size_t span = std::min(count, ring.size() - first);
+        Kernels::toPcm(ring.data() + first, samples, scale, span);
+        Kernels::toPcm(ring.data(), samples + span, scale, count - span);
+        tail += count;
+    }
+    
+    void PcmRing::read(std::vector<int32_t>& out, size_t count)
+    {
+        count = std::min(count, size());
+        size_t first = head & mask;
+        size_t span = std::min(count, ring.size() - first);
+        out.assign(ring.begin() + first, ring.begin() + first + span);
+        out.insert(out.end(), ring.begin(), ring.begin() + (count - span));
+        head += count;
+    }
+    
+}
\ No newline at end of file
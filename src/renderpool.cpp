@@ -0,0 +1,76 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "renderpool.hpp"
+
+namespace Synth {
+    
+    RenderPool::RenderPool(size_t threads) :
+        job {nullptr}, generation {0}, pending {0}, stopping {false}
+    {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (size_t i = 1; i < threads; i++) {
+            workers.emplace_back(&RenderPool::work, this, i);
+        }
+    }
+    
+    RenderPool::~RenderPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+    
+    void RenderPool::work(size_t id)
+    {
+        size_t seen = 0;
+        while (true) {
+            const std::function<void(size_t)> *task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+                task = job;
+            }
+            (*task)(id);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending--;
+            }
+            done.notify_one();
+        }
+    }
+    
+    void RenderPool::run(const std::function<void(size_t)>& task)
+    {
+        if (workers.empty()) {
+            task(0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &task;
+            pending = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        task(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return pending == 0; });
+    }
+    
+}
\ No newline at end of file
@@ -1,12 +1,19 @@
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
 #include <cmath>
+#include <functional>
 #include <istream>
+#include <limits>
 #include <iostream>
 #include <map>
+#include <string>
 #include <vector>
 
+#include "kernels.hpp"
+#include "renderpool.hpp"
 #include "synthutil.hpp"
+#include "wavetable.hpp"
 
 namespace Synth {
     
@@ -37,6 +44,52 @@ namespace Synth {
         return pre + (post - pre) * (eTime / interval);
     }
     
+    void Envelope::compile()
+    {
+        const float forever = std::numeric_limits<float>::infinity();
+        segments.clear();
+        if (sustainId >= envelope.size()) {
+            sustainId = envelope.size() - 1;
+        }
+        for (size_t i = 0; i < sustainId; i++) {
+            float interval = envelope[i + 1].first;
+            float rise = envelope[i + 1].second - envelope[i].second;
+            segments.push_back({envelope[i].second, interval > 0 ? rise / interval : 0, interval});
+        }
+        segments.push_back({envelope[sustainId].second, 0, forever});
+        releaseId = segments.size();
+        for (size_t i = sustainId; i + 1 < envelope.size(); i++) {
+            float interval = envelope[i + 1].first;
+            float rise = envelope[i + 1].second - envelope[i].second;
+            segments.push_back({envelope[i].second, interval > 0 ? rise / interval : 0, interval});
+        }
+        float silence = envelope.size() == 1 ? envelope[0].second : 0;
+        segments.push_back({silence, 0, forever});
+    }
+    
+    void Envelope::seek(EnvelopeCursor& cursor, float eTime, bool isActive) const
+    {
+        cursor.stage = isActive ? 0 : releaseId;
+        cursor.elapsed = 0;
+        advance(cursor, eTime);
+    }
+    
+    float Envelope::advance(EnvelopeCursor& cursor, float timeDelta) const
+    {
+        cursor.elapsed += timeDelta;
+        while (cursor.elapsed >= segments[cursor.stage].duration) {
+            cursor.elapsed -= segments[cursor.stage].duration;
+            cursor.stage++;
+        }
+        const Segment& segment = segments[cursor.stage];
+        return segment.start + segment.slope * cursor.elapsed;
+    }
+    
+    bool Envelope::isAlive(const EnvelopeCursor& cursor) const
+    {
+        return cursor.stage + 1 < segments.size();
+    }
+    
     bool Envelope::isAlive(float eTime, bool isActive) const
     {
         if (isActive) {
@@ -101,6 +154,57 @@ namespace Synth {
         return dca.isAlive(eTime, isActive);
     }
     
+    bool Synth::isAlive(const PatchState& state) const
+    {
+        return dca.isAlive(state.dca);
+    }
+    
+    void Synth::seek(PatchState& state) const
+    {
+        dca.seek(state.dca, state.eTime, state.isActive);
+        dcw.seek(state.dcw, state.eTime, state.isActive);
+        dco.seek(state.dco, state.eTime, state.isActive);
+    }
+    
+    void Synth::modulate(PatchState& state, float timeDelta,
+        float& amplitude, float& param, float& rate) const
+    {
+        float phase = (state.time + timeDelta) * 2 * M_PI;
+        amplitude = dca.advance(state.dca, timeDelta) * (1 + tremelo(phase));
+        param = dcw.advance(state.dcw, timeDelta);
+        rate = pow(2, (dco.advance(state.dco, timeDelta) + vibrato(phase)) / 12.0);
+    }
+    
+    void Synth::render(const float *phase, const float *param, const float *amplitude,
+        float phaseDelta, float& previous, uint32_t seed, uint64_t clock, float *out,
+        size_t count) const
+    {
+        if (shape == noise) {
+            Kernels::noise(param, amplitude, seed, clock, previous, out, count);
+            return;
+        }
+        if (shape == sinSaw) {
+            Kernels::sinSaw(phase, param, out, count);
+        }
+        else if (shape == resonantSaw) {
+            Kernels::resonantSaw(phase, param, out, count);
+        }
+        else if (shape == wavetable) {
+            Wavetable::bank().render(phase, param, phaseDelta, out, count);
+        }
+        else {
+            for (size_t i = 0; i < count; i++) {
+                previous = shape(phase[i], param[i], previous) * amplitude[i];
+                out[i] = previous;
+            }
+            return;
+        }
+        Kernels::multiply(out, amplitude, count);
+        if (count) {
+            previous = out[count - 1];
+        }
+    }
+    
     float Synth::sinSaw(float phase, float param, float previous)
     {
         float sine = LFO::sine(phase);
@@ -117,10 +221,16 @@ namespace Synth {
     
     float Synth::noise(float phase, float param, float previous)
     {
-        float next = rand() / (float)RAND_MAX;
+        static thread_local uint64_t counter = 0; // A stream per thread, for samples drawn outside a voice
+        float next = Kernels::noiseAt(0, counter++);
         return previous + (next - previous) * param;
     }
     
+    float Synth::wavetable(float phase, float param, float previous)
+    {
+        return Wavetable::bank()(phase, param);
+    }
+    
     bool Patch::operator()(PatchState& state, float frequency, float samplerate) const
     {
         size_t synthNum = state.phase / (2 * M_PI * synths.size());
@@ -139,21 +249,644 @@ namespace Synth {
         return synth.isAlive(state.eTime, state.isActive);
     }
     
-    void PlayingNote::writeFloats(std::vector<float>& samples, float samplerate, int maxNotes)
+    // Samples a ramp of count fills, whole vectors of them
+    static inline size_t rampLength(size_t count)
+    {
+        return (count + 7) & ~size_t{7};
+    }
+    
+    // Growth across a block beyond which the series below loses precision
+    const static float SERIES_GROWTH = 1;
+    
+    // (e^x - 1) / x, exact to float precision for |x| up to SERIES_GROWTH
+    static inline float growthSeries(float x)
+    {
+        return 1 + x * (1.0f / 2 + x * (1.0f / 6 + x * (1.0f / 24 + x * (1.0f / 120 +
+            x * (1.0f / 720 + x * (1.0f / 5040 + x * (1.0f / 40320 + x * (1.0f / 362880))))))));
+    }
+    
+    /*
+     * Phase of sample j of the control block, the phase step growing
+     * geometrically across it so the pitch glides evenly in semitones. Closed
+     * form, so a block can be skipped without visiting its samples and still
+     * land on the phase rendering it would have.
+     */
+    static inline float blockPhase(const PatchState& state, float samples, float period)
+    {
+        float growth = samples * state.phaseGrowth;
+        float phase = state.blockPhase + (std::fabs(state.phaseGrowth * state.length) <= SERIES_GROWTH ?
+            state.phaseScale * samples * growthSeries(growth) : state.phaseScale * std::expm1(growth));
+        phase -= period * (int)(phase * (1 / period)); // Never negative, so truncation floors
+        if (phase >= 0 && phase < period) {
+            return phase;
+        }
+        // Rounding at either end of the period; wrap it as operator() does
+        phase = std::fmod(phase, period);
+        phase += phase < 0 ? period : 0;
+        return phase < period ? phase : 0; // A tiny negative phase can round up to period
+    }
+    
+    const Synth& Patch::ramp(PatchState& state, float frequency, float samplerate, size_t count,
+        size_t blockLength, float *__restrict phases, float *__restrict params, float *__restrict amplitudes,
+        bool& alive) const
+    {
+        size_t synthNum = state.phase / (2 * M_PI * synths.size());
+        float offset = synthNum * synths.size();
+        const Synth& synth = synths[synthNum];
+        float timeDelta = 1.0 / samplerate;
+        if (state.offset == 0) {
+            state.time = state.clock * timeDelta;
+            state.eTime = state.eClock * timeDelta;
+            if (!state.primed) {
+                synth.seek(state);
+                synth.modulate(state, 0, state.amplitude, state.param, state.rate);
+                state.primed = true;
+            }
+            float amplitude, param, rate;
+            synth.modulate(state, timeDelta * blockLength, amplitude, param, rate);
+            state.ampStart = state.amplitude;
+            state.ampStep = (amplitude - state.amplitude) / blockLength;
+            state.paramStart = state.param;
+            state.paramStep = (param - state.param) / blockLength;
+            state.blockPhase = state.phase;
+            state.phaseDelta = 2 * M_PI * frequency * state.rate * timeDelta;
+            float ratio = rate / state.rate;
+            state.phaseGrowth = ratio > 0 && std::isfinite(ratio) ? std::log(ratio) / blockLength : 0;
+            // Steps sum to phaseDelta * (r^j - 1) / (r - 1), with r = e^phaseGrowth
+            state.phaseScale = std::fabs(state.phaseGrowth * blockLength) <= SERIES_GROWTH ?
+                state.phaseDelta / growthSeries(state.phaseGrowth) : state.phaseDelta / std::expm1(state.phaseGrowth);
+            state.peakDelta = state.phaseDelta * std::max(1.0f, ratio);
+            state.amplitude = amplitude;
+            state.param = param;
+            state.rate = rate;
+            state.length = blockLength;
+        }
+        float period = 2 * M_PI * synths.size();
+        if (phases) {
+            int first = state.offset;
+            int padded = rampLength(count); // A whole number of vectors, which the compiler will vectorise
+            for (int i = 0; i < padded; i++) {
+                float j = first + i;
+                phases[i] = blockPhase(state, j, period) - offset;
+                params[i] = state.paramStart + state.paramStep * j;
+                amplitudes[i] = state.ampStart + state.ampStep * j;
+            }
+        }
+        state.clock += count;
+        state.eClock += count;
+        state.offset += count;
+        alive = true;
+        if (state.offset == state.length) {
+            state.offset = 0;
+            state.phase = blockPhase(state, state.length, period);
+            alive = synth.isAlive(state);
+        }
+        return synth;
+    }
+    
+    void Patch::endBlock(PatchState& state) const
+    {
+        if (state.offset) {
+            state.phase = blockPhase(state, state.offset, 2 * M_PI * synths.size());
+            state.offset = 0;
+        }
+    }
+    
+    bool Patch::render(PatchState& state, float frequency, float samplerate, float *out, size_t count,
+        size_t blockLength) const
+    {
+        float phases[MAX_CONTROL_BLOCK];
+        float params[MAX_CONTROL_BLOCK];
+        float amplitudes[MAX_CONTROL_BLOCK];
+        float skipped[MAX_CONTROL_BLOCK];
+        bool alive;
+        bool filtered = !out && usesNoise(); // previous can't be skipped to, so render into scratch
+        uint64_t clock = state.clock;
+        const Synth& synth = ramp(state, frequency, samplerate, count, blockLength,
+            out || filtered ? phases : nullptr, params, amplitudes, alive);
+        if (out || filtered) {
+            synth.render(phases, params, amplitudes, state.peakDelta, state.previous, state.seed, clock,
+                out ? out : skipped, count);
+        }
+        return alive;
+    }
+    
+    bool Patch::usesNoise() const
+    {
+        for (auto& synth : synths) {
+            if (synth.shape == Synth::noise) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void PlayingNote::writeFloats(std::vector<float>& samples, float samplerate, int maxNotes, size_t controlBlock)
+    {
+        float block[MAX_CONTROL_BLOCK];
+        for (size_t i = 0; i < samples.size(); i += MAX_CONTROL_BLOCK) {
+            size_t count = std::min(MAX_CONTROL_BLOCK, samples.size() - i);
+            render(block, count, samplerate, controlBlock, i);
+            Kernels::accumulate(samples.data() + i, block, 1.0f / maxNotes, count);
+        }
+    }
+    
+    void PlayingNote::render(float *dst, size_t count, float samplerate, size_t controlBlock, uint64_t position)
+    {
+        if (fadeLength && !fadeLeft) {
+            if (dst) {
+                std::fill(dst, dst + count, 0);
+            }
+            isAlive = false;
+            return;
+        }
+        size_t i = 0;
+        while (i < count) {
+            size_t blockLength = controlBlock - (position + i) % controlBlock;
+            size_t block = std::min(state.offset ? state.length - state.offset : blockLength, count - i);
+            isAlive = patch->render(state, frequency, samplerate, dst ? dst + i : nullptr, block, blockLength);
+            i += block;
+        }
+        if (fadeLength) {
+            fadeOut(dst, count);
+        }
+    }
+    
+    void PlayingNote::fadeOut(float *dst, size_t count)
+    {
+        for (size_t i = 0; i < count; i++) {
+            if (dst) {
+                dst[i] *= (float)fadeLeft / fadeLength;
+            }
+            fadeLeft -= fadeLeft > 0;
+        }
+        isAlive = isAlive && fadeLeft;
+    }
+    
+    typedef void (*ShapeKernel)(const float *phase, const float *param, float *out, size_t count);
+    
+    // The kernel of a shape that treats every sample alone, so voices can share a call, or null
+    static ShapeKernel batchKernel(resfunc shape)
+    {
+        if (shape == Synth::sinSaw) {
+            return Kernels::sinSaw;
+        }
+        if (shape == Synth::resonantSaw) {
+            return Kernels::resonantSaw;
+        }
+        return nullptr;
+    }
+    
+    void PlayingNote::render(PlayingNote *const *voices, float *const *dst, size_t n, size_t count,
+        float samplerate, size_t controlBlock, uint64_t position)
+    {
+        float phases[BATCH_VOICES * MAX_CONTROL_BLOCK];
+        float params[BATCH_VOICES * MAX_CONTROL_BLOCK];
+        float amplitudes[BATCH_VOICES * MAX_CONTROL_BLOCK];
+        float out[BATCH_VOICES * MAX_CONTROL_BLOCK];
+        ShapeKernel kernels[BATCH_VOICES];
+        for (size_t i = 0; i < count;) {
+            // Every voice's blocks end on the grid, so this piece lies within one block of each
+            size_t blockLength = controlBlock - (position + i) % controlBlock;
+            size_t piece = std::min(blockLength, count - i);
+            size_t stride = rampLength(piece);
+            for (size_t v = 0; v < n; v++) {
+                PlayingNote& voice = *voices[v];
+                kernels[v] = nullptr;
+                if (voice.fadeLength && !voice.fadeLeft) {
+                    std::fill(dst[v] + i, dst[v] + i + piece, 0);
+                    voice.isAlive = false;
+                    continue;
+                }
+                float *phase = phases + v * stride;
+                float *param = params + v * stride;
+                float *amplitude = amplitudes + v * stride;
+                uint64_t clock = voice.state.clock;
+                const Synth& synth = voice.patch->ramp(voice.state, voice.frequency, samplerate, piece, blockLength,
+                    phase, param, amplitude, voice.isAlive);
+                kernels[v] = batchKernel(synth.shape);
+                if (!kernels[v]) {
+                    synth.render(phase, param, amplitude, voice.state.peakDelta, voice.state.previous,
+                        voice.state.seed, clock, dst[v] + i, piece);
+                }
+            }
+            // One kernel call for each run of voices with the same shape
+            for (size_t v = 0; v < n;) {
+                size_t end = v + 1;
+                if (kernels[v]) {
+                    while (end < n && kernels[end] == kernels[v]) {
+                        end++;
+                    }
+                    size_t offset = v * stride;
+                    kernels[v](phases + offset, params + offset, out + offset, (end - v) * stride);
+                    Kernels::multiply(out + offset, amplitudes + offset, (end - v) * stride);
+                    for (size_t w = v; w < end; w++) {
+                        std::copy(out + w * stride, out + w * stride + piece, dst[w] + i);
+                    }
+                }
+                v = end;
+            }
+            for (size_t v = 0; v < n; v++) {
+                if (voices[v]->fadeLength) {
+                    voices[v]->fadeOut(dst[v] + i, piece);
+                }
+            }
+            i += piece;
+        }
+    }
+    
+    float PlayingNote::level() const
+    {
+        return state.clock ? std::fabs(state.amplitude) : std::numeric_limits<float>::infinity();
+    }
+    
+    void PlayingNote::advance(size_t count, float samplerate, size_t controlBlock, uint64_t position)
+    {
+        render(nullptr, count, samplerate, controlBlock, position);
+    }
+    
+    VoicePool::VoicePool(size_t capacity, StealPolicy policy, uint32_t fadeLength) :
+        slots (KEYS, -1),
+        capacity {capacity},
+        live {0},
+        policy {policy},
+        fadeLength {fadeLength}
+    {
+        voices.reserve(fadeLength ? 2 * capacity : capacity);
+    }
+    
+    VoicePool::VoicePool(const VoicePool& other) :
+        slots {other.slots},
+        capacity {other.capacity},
+        live {other.live},
+        policy {other.policy},
+        fadeLength {other.fadeLength}
+    {
+        voices.reserve(fadeLength ? 2 * capacity : capacity);
+        voices.insert(voices.end(), other.voices.begin(), other.voices.end());
+    }
+    
+    VoicePool& VoicePool::operator=(const VoicePool& other)
+    {
+        slots = other.slots;
+        capacity = other.capacity;
+        live = other.live;
+        policy = other.policy;
+        fadeLength = other.fadeLength;
+        voices.clear();
+        voices.reserve(fadeLength ? 2 * capacity : capacity);
+        voices.insert(voices.end(), other.voices.begin(), other.voices.end());
+        return *this;
+    }
+    
+    size_t VoicePool::key(int channel, int note)
+    {
+        return (channel & 0xF) << 7 | (note & 0x7F);
+    }
+    
+    PlayingNote *VoicePool::find(int channel, int note)
+    {
+        int slot = slots[key(channel, note)];
+        return slot < 0 ? nullptr : &voices[slot];
+    }
+    
+    int VoicePool::victim() const
+    {
+        int best = -1;
+        for (size_t i = 0; i < voices.size(); i++) {
+            const PlayingNote& voice = voices[i];
+            if (voice.fading()) {
+                continue;
+            }
+            if (best < 0) {
+                best = i;
+                continue;
+            }
+            const PlayingNote& other = voices[best];
+            bool better;
+            if (policy == STEAL_QUIETEST) {
+                better = voice.level() < other.level();
+            }
+            else if (policy == STEAL_RELEASED && voice.released() != other.released()) {
+                better = voice.released();
+            }
+            else if (policy == STEAL_RELEASED && voice.released()) {
+                better = voice.level() < other.level();
+            }
+            else {
+                better = voice.age() > other.age();
+            }
+            if (better) {
+                best = i;
+            }
+        }
+        return best;
+    }
+    
+    bool VoicePool::start(const Patch& patch, float frequency, int channel, int note, uint32_t seed)
+    {
+        PlayingNote voice(patch, frequency, 0, true, true, channel, note, seed);
+        int& slot = slots[key(channel, note)];
+        if (slot >= 0) {
+            voices[slot] = voice;
+            return true;
+        }
+        if (live >= capacity) {
+            int stolen = victim();
+            if (stolen < 0) {
+                return false;
+            }
+            slots[key(voices[stolen].getChannel(), voices[stolen].getNote())] = -1;
+            if (!fadeLength || voices.size() >= 2 * capacity) {
+                voices[stolen] = voice; // No room to fade, so cut it off
+                slot = stolen;
+                return true;
+            }
+            voices[stolen].fade(fadeLength);
+            live--;
+        }
+        slot = voices.size();
+        voices.push_back(voice);
+        live++;
+        return true;
+    }
+    
+    void VoicePool::removeDead()
+    {
+        for (size_t i = 0; i < voices.size();) {
+            if (voices[i].alive()) {
+                i++;
+                continue;
+            }
+            if (!voices[i].fading()) { // A stolen voice gave its key up already
+                slots[key(voices[i].getChannel(), voices[i].getNote())] = -1;
+                live--;
+            }
+            if (i + 1 < voices.size()) {
+                voices[i] = voices.back();
+                if (!voices[i].fading()) {
+                    slots[key(voices[i].getChannel(), voices[i].getNote())] = i;
+                }
+            }
+            voices.pop_back();
+        }
+    }
+    
+    const static size_t CHANNELS = 16;
+    const static size_t SLICES_PER_THREAD = 4;
+    
+    static size_t mixChunk(size_t controlBlock)
+    {
+        return controlBlock * std::max(size_t{1}, RENDER_CHUNK / controlBlock);
+    }
+    
+    const static float STEAL_FADE_MSEC = 5; // Short enough to free the voice quickly, long enough not to click
+    
+    const static float CHECKPOINT_SEC = 10; // Song time between the states a Renderer keeps for seeking
+    
+    static uint32_t stealFade(float samplerate)
+    {
+        return STEAL_FADE_MSEC * samplerate / SEC_TO_MSEC;
+    }
+    
+    // Notes on a key not started before count towards keys
+    static void countKey(const Midi::MidiMessage& msg, std::vector<bool>& used, size_t& keys)
+    {
+        if ((msg.msgType & 0xF0) == Midi::NOTE_ON && msg.msgType < 0xF0) {
+            size_t key = (msg.msgType & 0xF) << 7 | (msg.data[0] & 0x7F);
+            keys += !used[key];
+            used[key] = true;
+        }
+    }
+    
+    // Room for every key the song starts, or the caller's limit if lower
+    static VoicePool makeVoices(size_t keys,
+        float samplerate,
+        const RenderOptions& options)
+    {
+        if (!options.maxVoices || options.maxVoices >= keys) {
+            return {keys};
+        }
+        return {options.maxVoices, options.steal, stealFade(samplerate)};
+    }
+    
+    static VoicePool makeVoices(const std::vector<Midi::MidiMessage>& track,
+        float samplerate,
+        const RenderOptions& options)
+    {
+        std::vector<bool> used(VoicePool::KEYS, false);
+        size_t keys = 0;
+        for (auto& msg : track) {
+            countKey(msg, used, keys);
+        }
+        return makeVoices(keys, samplerate, options);
+    }
+    
+    // Reads stream to its end, like Midi::maxPolyphony
+    static VoicePool makeVoices(Midi::EventStream& stream,
+        float samplerate,
+        const RenderOptions& options)
+    {
+        std::vector<bool> used(VoicePool::KEYS, false);
+        size_t keys = 0;
+        Midi::MidiMessage msg {0, 0};
+        while (stream.next(msg)) {
+            countKey(msg, used, keys);
+        }
+        return makeVoices(keys, samplerate, options);
+    }
+    
+    // Voices of a renderer that cannot see the whole song ahead of time
+    static size_t voiceLimit(const RenderOptions& options)
+    {
+        return options.maxVoices ? options.maxVoices : LIVE_VOICES;
+    }
+    
+    /*
+     * Renders every voice into its own slot a chunk at a time, then mixes the
+     * slots in voice order, so the sum does not depend on the thread count.
+     * Voices render in lockstep batches. Allocates only to grow slots.
+     */
+    static void renderVoices(RenderPool& pool,
+        VoicePool& voices,
+        std::vector<float>& slots,
+        float *samples,
+        size_t length,
+        uint64_t position,
+        float samplerate,
+        int maxNotes,
+        size_t controlBlock)
+    {
+        size_t chunk = mixChunk(controlBlock);
+        if (slots.size() < voices.size() * chunk) {
+            slots.resize(voices.size() * chunk);
+        }
+        size_t workers = pool.size();
+        size_t start, count;
+        auto body = [&](size_t worker) {
+            PlayingNote *batch[BATCH_VOICES];
+            float *outs[BATCH_VOICES];
+            size_t batched = 0;
+            for (size_t v = 0; v < voices.size(); v++) {
+                if (v % workers != worker) {
+                    continue;
+                }
+                batch[batched] = &voices[v];
+                outs[batched++] = slots.data() + v * chunk;
+                if (batched == BATCH_VOICES) {
+                    PlayingNote::render(batch, outs, batched, count, samplerate, controlBlock, position + start);
+                    batched = 0;
+                }
+            }
+            if (batched) {
+                PlayingNote::render(batch, outs, batched, count, samplerate, controlBlock, position + start);
+            }
+        };
+        std::function<void(size_t)> job = std::ref(body); // Held by reference, so nothing is allocated
+        for (start = 0; start < length; start += chunk) {
+            count = std::min(chunk, length - start);
+            pool.run(job);
+            for (size_t v = 0; v < voices.size(); v++) {
+                Kernels::accumulate(samples + start, slots.data() + v * chunk, 1.0f / maxNotes, count);
+            }
+        }
+    }
+    
+    Timeline::Timeline(const std::vector<Midi::MidiMessage>& track, const Midi::MidiHeader& header,
+        float samplerate) :
+        header {header},
+        samplerate {samplerate},
+        track {track}
+    {
+        Midi::TempoMap tempo(header);
+        uint64_t tick = 0;
+        samples.reserve(track.size());
+        for (auto& msg : track) {
+            tick += msg.deltaTime;
+            samples.push_back(tempo.sample(tick, samplerate));
+            if (msg.msgType == Midi::TEMPO) {
+                tempo.change(tick, ((uint32_t)msg.data[0] << 16) | ((uint32_t)msg.data[1] << 8) | msg.data[2]);
+            }
+        }
+    }
+    
+    size_t Timeline::find(uint64_t sample) const
+    {
+        return std::lower_bound(samples.begin(), samples.end(), sample) - samples.begin();
+    }
+    
+    SequencerState::SequencerState(const VoicePool& voices, const Midi::MidiHeader& header, uint32_t seed) :
+        programs {},
+        voices {voices},
+        tempo {header},
+        tick {0},
+        position {0},
+        seed {seed}
+    {}
+    
+    uint64_t SequencerState::when(const Midi::MidiMessage& msg, float samplerate) const
+    {
+        return tempo.sample(tick + msg.deltaTime, samplerate);
+    }
+    
+    void SequencerState::apply(const Midi::MidiMessage& msg, const std::vector<Patch>& patches)
+    {
+        tick += msg.deltaTime;
+        if (msg.msgType == Midi::TEMPO) {
+            tempo.change(tick, ((uint32_t)msg.data[0] << 16) | ((uint32_t)msg.data[1] << 8) | msg.data[2]);
+        }
+        else {
+            channelEvent(msg.msgType, msg.data, patches);
+        }
+    }
+    
+    // Noise seed of a note, from what places it in the song, so every render of the song gives it the same noise
+    static uint32_t noteSeed(uint32_t seed, int channel, int note, uint64_t position)
+    {
+        uint64_t key = (position * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)seed << 32) ^ (channel << 7 | note);
+        return key ^ (key >> 32);
+    }
+    
+    void SequencerState::channelEvent(uint16_t msgType, const uint8_t *data, const std::vector<Patch>& patches)
+    {
+        if ((msgType & 0xF0) != Midi::NOTE_ON && (msgType & 0xF0) != Midi::NOTE_OFF) {
+            return;
+        }
+        int channel = msgType & 0xF;
+        int nid = data[0];
+        if ((msgType & 0xF0) == Midi::NOTE_ON) {
+            size_t index;
+            if (channel == 9) { // Drums
+                index = patches.size() - 1;
+            }
+            else {
+                index = programs[channel];
+            }
+            voices.start(patches[index], Midi::noteToFrequency(nid, 0), channel, nid,
+                noteSeed(seed, channel, nid, position));
+        }
+        else {
+            PlayingNote *note = voices.find(channel, nid);
+            if (note) {
+                note->stop();
+            }
+        }
+    }
+    
+    /*
+     * Plays events [begin, end) of a timeline through func. Each event lands
+     * on the sample the timeline gives it, so any subset of the timeline
+     * places its notes exactly where the full song does. With no func the
+     * voices are only advanced, which costs a fraction of rendering them.
+     */
+    static void sequence(const Timeline& timeline,
+        size_t begin,
+        size_t end,
+        SequencerState& state,
+        callback func,
+        const std::vector<Patch>& patches,
+        void *data,
+        size_t controlBlock,
+        int maxNotes,
+        RenderPool& pool)
     {
-        for (auto it = samples.begin(); it != samples.end(); it++) {
-            isAlive = patch(state, frequency, samplerate);
-            *it += state.previous / maxNotes;
+        VoicePool& voices = state.voices;
+        std::vector<float> fSamples;
+        std::vector<float> slots;
+        for (size_t m = begin; m < end; m++) {
+            const Midi::MidiMessage& msg = timeline.track[m];
+            if (msg.deltaTime) {
+                uint64_t next = timeline.samples[m];
+                size_t numSamples = next - state.position;
+                if (func) {
+                    fSamples.assign(numSamples, 0); // Reuses its storage once grown
+                    renderVoices(pool, voices, slots, fSamples.data(), fSamples.size(), state.position,
+                        timeline.samplerate, maxNotes, controlBlock);
+                    func(fSamples, data, voices);
+                }
+                else {
+                    for (size_t v = 0; v < voices.size(); v++) {
+                        voices[v].advance(numSamples, timeline.samplerate, controlBlock, state.position);
+                    }
+                }
+                state.position = next;
+                voices.removeDead();
+            }
+            state.apply(msg, patches);
         }
     }
     
-    const static uint32_t DEFAULT_TEMPO = 500000;
+    static size_t clampBlock(const RenderOptions& options)
+    {
+        return std::max(size_t{1}, std::min(options.controlBlock, MAX_CONTROL_BLOCK));
+    }
     
     void play(std::istream& stream,
         float samplerate,
         callback func,
         const std::vector<Patch>& patches,
-        void *data)
+        void *data,
+        const RenderOptions& options)
     {
         Midi::MidiHeader header;
         Midi::readHeader(stream, header);
@@ -161,10 +894,10 @@ namespace Synth {
         for (size_t i = 0; i < header.ntrks; i++) {
             std::vector<Midi::MidiMessage> track;
             Midi::readTrack(stream, track);
-            tracks.push_back(track);
+            tracks.push_back(std::move(track));
         }
         std::vector<Midi::MidiMessage> track = Midi::joinTracks(tracks);
-        play(track, header, samplerate, func, patches, data);
+        play(track, header, samplerate, func, patches, data, options);
     }
     
     void play(const std::vector<Midi::MidiMessage>& track,
@@ -172,67 +905,384 @@ namespace Synth {
         float samplerate,
         callback func,
         const std::vector<Patch>& patches,
-        void *data)
+        void *data,
+        const RenderOptions& options)
     {
-        float samplesPerMsec = samplerate / SEC_TO_MSEC;
+        play(Timeline(track, header, samplerate), func, patches, data, options);
+    }
+    
+    void play(const Timeline& timeline,
+        callback func,
+        const std::vector<Patch>& patches,
+        void *data,
+        const RenderOptions& options)
+    {
+        RenderPool pool(options.threads);
+        SequencerState state(makeVoices(timeline.track, timeline.samplerate, options), timeline.header, options.seed);
+        sequence(timeline, 0, timeline.track.size(), state, func, patches, data,
+            clampBlock(options), Midi::maxPolyphony(timeline.track), pool);
+    }
+    
+    bool playFile(const std::string& path,
+        float samplerate,
+        callback func,
+        const std::vector<Patch>& patches,
+        void *data,
+        const RenderOptions& options)
+    {
+        Renderer renderer(path, samplerate, patches, options);
+        if (!renderer.good()) {
+            return false;
+        }
+        std::vector<float> samples;
+        while (!renderer.finished()) {
+            samples.resize(RENDER_CHUNK); // Within its storage after the first block
+            samples.resize(renderer.render(samples.data(), samples.size()));
+            if (!samples.empty()) { // The song may end on the block before
+                func(samples, data, renderer.voices());
+            }
+        }
+        return renderer.good();
+    }
+    
+    static void appendSamples(const std::vector<float>& samples,
+        void *data,
+        const VoicePool& notes)
+    {
+        std::vector<float> *stem = static_cast<std::vector<float>*>(data);
+        stem->insert(stem->end(), samples.begin(), samples.end());
+    }
+    
+    Stems renderStems(const std::vector<Midi::MidiMessage>& track,
+        const Midi::MidiHeader& header,
+        float samplerate,
+        const std::vector<Patch>& patches,
+        const RenderOptions& options)
+    {
+        // Split the timeline by channel, giving every part the song's end
+        Timeline timeline(track, header, samplerate);
+        std::vector<Timeline> parts(CHANNELS, Timeline(header, samplerate));
+        std::vector<uint64_t> lastTicks(CHANNELS, 0);
+        std::vector<bool> sounding(CHANNELS, false);
+        uint64_t ticks = 0;
+        for (size_t m = 0; m < track.size(); m++) {
+            const Midi::MidiMessage& msg = track[m];
+            ticks += msg.deltaTime;
+            if (msg.msgType < 0xF0) {
+                size_t c = msg.msgType & 0xF;
+                parts[c].track.push_back({(uint32_t)(ticks - lastTicks[c]), msg.msgType, msg.data, msg.length});
+                parts[c].samples.push_back(timeline.samples[m]);
+                lastTicks[c] = ticks;
+                sounding[c] = sounding[c] || (msg.msgType & 0xF0) == Midi::NOTE_ON;
+            }
+        }
+        for (size_t c = 0; c < CHANNELS; c++) {
+            parts[c].track.push_back({(uint32_t)(ticks - lastTicks[c]), Midi::END_OF_TRACK});
+            parts[c].samples.push_back(timeline.samples.empty() ? 0 : timeline.samples.back());
+        }
         int maxNotes = Midi::maxPolyphony(track);
-        std::map<int, int> programs;
-        std::map<std::pair<int, int>, PlayingNote> playingNotes;
-        std::vector<float> fSamples;
-        uint32_t usecPerQNote = DEFAULT_TEMPO;
-        for (auto msg : track) {
-            if (msg.deltaTime) {
-                float ms = header.miliseconds(msg.deltaTime, usecPerQNote);
-                size_t numSamples = ms * samplesPerMsec;
-                fSamples.resize(numSamples);
-                std::fill(fSamples.begin(), fSamples.end(), 0);
-                for (auto it = playingNotes.begin(); it != playingNotes.end(); it++) {
-                    it->second.writeFloats(fSamples, samplerate, maxNotes);
-                }
-                func(fSamples, data, playingNotes);
-                for (auto it = playingNotes.begin(); it != playingNotes.end();) {
-                    if (!it->second.alive())
-                    {
-                        it = playingNotes.erase(it);
-                    }
-                    else {
-                        it ++;
-                    }
+        Stems stems;
+        stems.channels.resize(CHANNELS);
+        RenderPool pool(options.threads);
+        pool.run([&](size_t worker) {
+            RenderPool single(1);
+            for (size_t c = worker; c < CHANNELS; c += pool.size()) {
+                if (sounding[c]) {
+                    SequencerState state(makeVoices(parts[c].track, samplerate, options), header, options.seed);
+                    sequence(parts[c], 0, parts[c].track.size(), state, appendSamples, patches,
+                        &stems.channels[c], clampBlock(options), maxNotes, single);
                 }
             }
-            if (msg.msgType == Midi::TEMPO) {
-                usecPerQNote = ((uint32_t)msg.data[0] << 16) |
-                    ((uint32_t)msg.data[1] << 8) |
-                    ((uint32_t)msg.data[2]);
-            }
-            else if ((msg.msgType & 0xF0) == Midi::NOTE_ON ||
-                (msg.msgType & 0xF0) == Midi::NOTE_OFF) {
-                int channel = msg.msgType & 0xF;
-                int nid = msg.data[0];
-                if ((msg.msgType & 0xF0) == Midi::NOTE_ON) {
-                    size_t index;
-                    if (channel == 9) { // Drums
-                        index = patches.size() - 1;
-                    }
-                    else if (programs.find(channel) == programs.end()) {
-                        programs[channel] = 0;
-                        index = 0;
-                    }
-                    else {
-                        index = programs[channel];
-                    }
-                    const Patch& patch = patches[index];
-                    PlayingNote note(patch, Midi::noteToFrequency(nid, 0));
-                    playingNotes.insert({{channel, nid}, note});
-                }
-                else {
-                    auto it = playingNotes.find({channel, nid});
-                    if (it != playingNotes.end()) {
-                        it->second.stop();
-                    }
+        });
+        for (auto& stem : stems.channels) {
+            if (stem.size() > stems.mix.size()) {
+                stems.mix.resize(stem.size(), 0);
+            }
+            Kernels::accumulate(stems.mix.data(), stem.data(), 1, stem.size());
+        }
+        return stems;
+    }
+    
+    std::vector<float> renderSliced(const std::vector<Midi::MidiMessage>& track,
+        const Midi::MidiHeader& header,
+        float samplerate,
+        const std::vector<Patch>& patches,
+        const RenderOptions& options)
+    {
+        return renderSliced(Timeline(track, header, samplerate), patches, options);
+    }
+    
+    std::vector<float> renderSliced(const Timeline& timeline,
+        const std::vector<Patch>& patches,
+        const RenderOptions& options)
+    {
+        const std::vector<Midi::MidiMessage>& track = timeline.track;
+        size_t controlBlock = clampBlock(options);
+        int maxNotes = Midi::maxPolyphony(track);
+        RenderPool pool(options.threads);
+        size_t slices = options.slices ? options.slices : pool.size() * SLICES_PER_THREAD;
+        // Cut before events that end a gap, as evenly in ticks as the events allow
+        uint64_t totalTicks = 0;
+        for (auto& msg : track) {
+            totalTicks += msg.deltaTime;
+        }
+        std::vector<size_t> cuts {0};
+        uint64_t ticks = 0;
+        for (size_t i = 0; i < track.size(); i++) {
+            if (track[i].deltaTime && cuts.size() < slices && ticks * slices >= totalTicks * cuts.size()) {
+                cuts.push_back(i);
+            }
+            ticks += track[i].deltaTime;
+        }
+        cuts.push_back(track.size());
+        // Dry pass for the state at each cut
+        std::vector<SequencerState> starts;
+        SequencerState state(makeVoices(track, timeline.samplerate, options), timeline.header, options.seed);
+        for (size_t k = 0; k + 1 < cuts.size(); k++) {
+            starts.push_back(state);
+            if (k + 2 < cuts.size()) {
+                sequence(timeline, cuts[k], cuts[k + 1], state, nullptr, patches, nullptr,
+                    controlBlock, maxNotes, pool);
+            }
+        }
+        std::vector<std::vector<float>> parts(starts.size());
+        pool.run([&](size_t worker) {
+            RenderPool single(1);
+            for (size_t k = worker; k < starts.size(); k += pool.size()) {
+                sequence(timeline, cuts[k], cuts[k + 1], starts[k], appendSamples, patches,
+                    &parts[k], controlBlock, maxNotes, single);
+            }
+        });
+        size_t total = 0;
+        for (auto& part : parts) {
+            total += part.size();
+        }
+        std::vector<float> samples;
+        samples.reserve(total);
+        for (auto& part : parts) {
+            samples.insert(samples.end(), part.begin(), part.end());
+        }
+        return samples;
+    }
+    
+    Renderer::Renderer(const std::vector<Midi::MidiMessage>& track,
+        const Midi::MidiHeader& header,
+        float samplerate,
+        const std::vector<Patch>& patches,
+        const RenderOptions& options) :
+        Renderer(Timeline(track, header, samplerate), patches, options)
+    {}
+    
+    Renderer::Renderer(const Timeline& timeline,
+        const std::vector<Patch>& patches,
+        const RenderOptions& options) :
+        timeline {timeline},
+        patches {patches},
+        controlBlock {clampBlock(options)},
+        maxNotes {Midi::maxPolyphony(timeline.track)},
+        pool {options.threads},
+        state {makeVoices(timeline.track, timeline.samplerate, options), timeline.header, options.seed},
+        next {0},
+        slots (state.voices.room() * mixChunk(controlBlock)),
+        events {nullptr},
+        stream {std::vector<Midi::TrackReader>()},
+        pending {0, 0},
+        streaming {false},
+        valid {true}
+    {
+        save();
+    }
+    
+    Renderer::Renderer(EventQueue& events,
+        float samplerate,
+        const std::vector<Patch>& patches,
+        const RenderOptions& options) :
+        timeline {{}, samplerate},
+        patches {patches},
+        controlBlock {clampBlock(options)},
+        maxNotes {(int)voiceLimit(options)},
+        pool {options.threads},
+        state {VoicePool(voiceLimit(options), options.steal, stealFade(samplerate)), {}, options.seed},
+        next {0},
+        slots (state.voices.room() * mixChunk(controlBlock)),
+        events {&events},
+        stream {std::vector<Midi::TrackReader>()},
+        pending {0, 0},
+        streaming {false},
+        valid {true}
+    {
+        save();
+    }
+    
+    Renderer::Renderer(const std::string& path,
+        float samplerate,
+        const std::vector<Patch>& patches,
+        const RenderOptions& options) :
+        timeline {{}, samplerate},
+        patches {patches},
+        controlBlock {clampBlock(options)},
+        maxNotes {(int)voiceLimit(options)},
+        pool {options.threads},
+        state {VoicePool(voiceLimit(options), options.steal, stealFade(samplerate)), {}, options.seed},
+        next {0},
+        events {nullptr},
+        stream {std::vector<Midi::TrackReader>()},
+        pending {0, 0},
+        streaming {false},
+        valid {false}
+    {
+        valid = open(path, options);
+        if (valid) {
+            slots.resize(state.voices.room() * mixChunk(controlBlock));
+            streaming = stream.next(pending);
+        }
+        save();
+    }
+    
+    /*
+     * Maps the file and finds its tracks, decoding none of them unless
+     * options.scan asks to size the voices from the whole song as play() does.
+     * False, with nothing to play, if any of it is missing or malformed.
+     */
+    bool Renderer::open(const std::string& path, const RenderOptions& options)
+    {
+        if (!file.open(path)) {
+            return false;
+        }
+        Midi::MidiParser parser(file.data(), file.size());
+        if (!parser.readHeader(timeline.header)) {
+            return false;
+        }
+        state.tempo = Midi::TempoMap(timeline.header);
+        std::vector<Midi::TrackReader> readers(timeline.header.ntrks);
+        for (auto& reader : readers) {
+            if (!parser.nextTrack(reader)) {
+                return false;
+            }
+        }
+        stream = Midi::EventStream(readers);
+        if (!options.scan) {
+            return true;
+        }
+        Midi::EventStream scan = stream;
+        maxNotes = Midi::maxPolyphony(scan);
+        if (!scan.good()) {
+            return false;
+        }
+        scan = stream;
+        state = SequencerState(makeVoices(scan, timeline.samplerate, options), timeline.header, options.seed);
+        return true;
+    }
+    
+    /*
+     * Applies every event due by now and returns the sample of the next one,
+     * or the largest position if none is known yet.
+     */
+    uint64_t Renderer::schedule()
+    {
+        if (streaming) {
+            while (streaming && state.when(pending, timeline.samplerate) <= state.position) {
+                if (pending.deltaTime) {
+                    state.voices.removeDead();
                 }
+                state.apply(pending, patches);
+                streaming = stream.next(pending);
+            }
+            return streaming ? state.when(pending, timeline.samplerate) : UINT64_MAX;
+        }
+        if (events) {
+            state.voices.removeDead();
+            const LiveEvent *event;
+            while ((event = events->front()) && event->time <= state.position) {
+                state.channelEvent(event->msgType, event->data, patches);
+                events->pop();
+            }
+            return event ? event->time : UINT64_MAX;
+        }
+        const std::vector<Midi::MidiMessage>& track = timeline.track;
+        while (next < track.size() && timeline.samples[next] <= state.position) {
+            if (track[next].deltaTime) {
+                state.voices.removeDead(); // Where play() does, so voices mix in the same order
+            }
+            state.apply(track[next++], patches);
+        }
+        return next < track.size() ? timeline.samples[next] : UINT64_MAX;
+    }
+    
+    void Renderer::save()
+    {
+        checkpoints.push_back({state, next, stream, pending, streaming});
+    }
+    
+    void Renderer::restore(const Checkpoint& checkpoint)
+    {
+        state = checkpoint.state;
+        next = checkpoint.next;
+        stream = checkpoint.stream;
+        pending = checkpoint.pending;
+        streaming = checkpoint.streaming;
+    }
+    
+    bool Renderer::seek(uint64_t sample)
+    {
+        if (events) {
+            return false;
+        }
+        // Resume from the last checkpoint before sample, unless already nearer
+        auto after = std::upper_bound(checkpoints.begin(), checkpoints.end(), sample,
+            [](uint64_t sample, const Checkpoint& checkpoint) {return sample < checkpoint.state.position;});
+        const Checkpoint& nearest = *(after - 1);
+        if (sample < state.position || nearest.state.position > state.position) {
+            restore(nearest);
+        }
+        // Then step through the events dry, just as render() would
+        uint64_t interval = CHECKPOINT_SEC * timeline.samplerate;
+        while (state.position < sample) {
+            uint64_t until = std::min(schedule(), sample);
+            if (finished()) {
+                break;
             }
+            if (state.position >= checkpoints.back().state.position + interval) {
+                save();
+            }
+            for (size_t v = 0; v < state.voices.size(); v++) {
+                state.voices[v].advance(until - state.position, timeline.samplerate, controlBlock, state.position);
+            }
+            state.position = until;
         }
+        return true;
+    }
+    
+    size_t Renderer::render(float *out, size_t frames)
+    {
+        size_t done = 0;
+        while (done < frames) {
+            uint64_t until = schedule();
+            if (finished()) {
+                break;
+            }
+            size_t count = std::min<uint64_t>(frames - done, until - state.position);
+            std::fill(out + done, out + done + count, 0);
+            renderVoices(pool, state.voices, slots, out + done, count, state.position, timeline.samplerate,
+                maxNotes, controlBlock);
+            state.position += count;
+            done += count;
+        }
+        std::fill(out + done, out + frames, 0);
+        return done;
+    }
+    
+    std::vector<float> renderRange(const Timeline& timeline,
+        uint64_t begin,
+        uint64_t end,
+        const std::vector<Patch>& patches,
+        const RenderOptions& options)
+    {
+        Renderer renderer(timeline, patches, options);
+        renderer.seek(begin);
+        std::vector<float> samples(end > begin ? end - begin : 0);
+        samples.resize(renderer.render(samples.data(), samples.size()));
+        return samples;
     }
     
 }
\ No newline at end of file
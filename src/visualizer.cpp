@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "synthutil.hpp"
+
+namespace Synth {
+    
+    Visualizer::Visualizer(
+        float samplerate,
+        float fps,
+        int width,
+        int height,
+        int bps,
+        std::ostream& stream,
+        int jpegQuality,
+        size_t queueLength,
+        size_t encoders) :
+        outputs (std::max(size_t{2}, queueLength)),
+        head {0},
+        written {0},
+        claimed {0},
+        tail {0},
+        frames {0},
+        stopping {false},
+        dropping {false},
+        samplerate {samplerate},
+        framerate {fps},
+        sampleNorm ((1 << (bps - 1)) - 1),
+        bps {bps},
+        width {width},
+        height {height},
+        fmavi {
+            width, height, fps, bps, samplerate, 1, Avi::NORMAL, jpegQuality
+        },
+        out {stream}
+    {
+        fmavi.prepare(out);
+        writer = std::thread(&Visualizer::write, this);
+        for (size_t i = 0; i < std::max(size_t{1}, encoders); i++) {
+            this->encoders.emplace_back(&Visualizer::encode, this, i);
+        }
+    }
+    
+    Visualizer::~Visualizer()
+    {
+        stop();
+    }
+    
+    Visualizer::Output& Visualizer::reserve()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        freed.wait(lock, [this] {return tail - head < outputs.size();});
+        return outputs[tail % outputs.size()];
+    }
+    
+    void Visualizer::submit()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tail++;
+        }
+        queued.notify_all();
+    }
+    
+    void Visualizer::release()
+    {
+        size_t before = head;
+        // Past both the writer and the encoders, which may not have looked at audio yet
+        while (head < written && head < claimed && outputs[head % outputs.size()].encoded) {
+            head++;
+        }
+        if (head != before) {
+            freed.notify_one();
+        }
+    }
+    
+    void Visualizer::writeSamples(size_t count)
+    {
+        Output& output = reserve();
+        output.video = false;
+        output.encoded = true;
+        buffer.read(output.samples, count);
+        submit();
+    }
+    
+    std::vector<std::uint8_t>& Visualizer::nextFrame()
+    {
+        Output& output = reserve();
+        output.rgb.resize((size_t)width * height * 3); // Only the first use of a buffer allocates
+        return output.rgb;
+    }
+    
+    void Visualizer::writeFrame()
+    {
+        Output& output = reserve(); // Already free, since nextFrame waited for it
+        output.video = true;
+        output.encoded = false;
+        output.frame = frames++;
+        submit();
+    }
+    
+    // Writes outputs in the order they were queued, until stopped with none left or dropping them
+    void Visualizer::write()
+    {
+        while (true) {
+            Output *output;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [this] {return written != tail || stopping;});
+                if (written == tail || dropping) {
+                    return;
+                }
+                output = &outputs[written % outputs.size()];
+            }
+            if (output->video) {
+                fmavi.writeVideoFrame(out, output->rgb.data());
+            }
+            else {
+                fmavi.writeSamples(out, output->samples);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            written++;
+            release();
+        }
+    }
+    
+    // Takes queued frames in turn, however long other encoders take with theirs
+    void Visualizer::encode(size_t encoder)
+    {
+        while (true) {
+            Output *output;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [this] {return claimed != tail || stopping;});
+                if (claimed == tail || dropping) {
+                    return;
+                }
+                output = &outputs[claimed++ % outputs.size()];
+                if (!output->video) {
+                    release();
+                    continue;
+                }
+            }
+            encodeFrame(output->rgb, output->frame, encoder);
+            std::lock_guard<std::mutex> lock(mutex);
+            output->encoded = true;
+            release();
+        }
+    }
+    
+    void Visualizer::join(bool drain)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            dropping = !drain;
+        }
+        queued.notify_all();
+        if (writer.joinable()) {
+            writer.join();
+        }
+        for (auto& encoder : encoders) {
+            if (encoder.joinable()) {
+                encoder.join();
+            }
+        }
+    }
+    
+    void Visualizer::stop()
+    {
+        join(false);
+    }
+    
+    void Visualizer::finish()
+    {
+        writeSamples(buffer.size());
+        join(true);
+        fmavi.finish(out);
+    }
+    
+}
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include "wavetable.hpp"
+
+namespace Synth {
+    
+    const static size_t STRIDE = Wavetable::TABLE_SIZE + 1; // Guard sample for interpolation
+    const static float RADIANS_TO_INDEX = Wavetable::TABLE_SIZE / (2 * M_PI);
+    
+    // Fourier sine coefficient of harmonic k for a frame. The sine and saw match the LFO shapes'
+    // phase; the triangle starts at zero like the sine, a quarter period ahead of LFO::triangle.
+    static float coefficient(size_t frame, size_t k)
+    {
+        switch (frame) {
+            case Wavetable::SINE:
+                return k == 1 ? 1 : 0;
+            case Wavetable::TRIANGLE:
+                if (!(k & 1)) {
+                    return 0;
+                }
+                return ((k & 2) ? -8 : 8) / (M_PI * M_PI * k * k);
+            case Wavetable::SAW:
+                return -2 / (M_PI * k);
+            case Wavetable::SQUARE:
+                return (k & 1) ? 4 / (M_PI * k) : 0;
+        }
+        return 0;
+    }
+    
+    Wavetable::Wavetable() :
+        tables(LEVELS * FRAMES * STRIDE)
+    {
+        std::vector<float> sine(TABLE_SIZE);
+        for (size_t n = 0; n < TABLE_SIZE; n++) {
+            sine[n] = std::sin(2 * M_PI * n / TABLE_SIZE);
+        }
+        std::vector<float> sum(TABLE_SIZE);
+        for (size_t frame = 0; frame < FRAMES; frame++) {
+            std::fill(sum.begin(), sum.end(), 0);
+            size_t harmonic = 1;
+            // Each level down adds the harmonics of the next octave to the one above
+            for (size_t level = LEVELS; level-- > 0;) {
+                for (; harmonic <= (HARMONICS >> level); harmonic++) {
+                    float c = coefficient(frame, harmonic);
+                    if (c == 0) {
+                        continue;
+                    }
+                    for (size_t n = 0; n < TABLE_SIZE; n++) {
+                        sum[n] += c * sine[(harmonic * n) & (TABLE_SIZE - 1)];
+                    }
+                }
+                float *dst = tables.data() + (level * FRAMES + frame) * STRIDE;
+                std::copy(sum.begin(), sum.end(), dst);
+                dst[TABLE_SIZE] = sum[0];
+            }
+        }
+    }
+    
+    const Wavetable& Wavetable::bank()
+    {
+        static const Wavetable wavetable;
+        return wavetable;
+    }
+    
+    size_t Wavetable::level(float phaseDelta)
+    {
+        float limit = M_PI / phaseDelta; // Harmonics below Nyquist
+        size_t level = 0;
+        while (level + 1 < LEVELS && (HARMONICS >> level) > limit) {
+            level++;
+        }
+        return level;
+    }
+    
+    const float *Wavetable::table(size_t level, size_t frame) const
+    {
+        return tables.data() + (level * FRAMES + frame) * STRIDE;
+    }
+    
+    // Reads a frame pair at one level, interpolating along the cycle and between frames
+    static inline float lookup(const float *base, float phase, float param)
+    {
+        const size_t frames = Wavetable::FRAMES;
+        float position = phase * RADIANS_TO_INDEX;
+        size_t index = (size_t)position;
+        float frac = position - index;
+        index &= Wavetable::TABLE_SIZE - 1;
+        float morph = std::min(std::max(param, 0.0f), (float)(frames - 1));
+        size_t frame = std::min((size_t)morph, frames - 2);
+        float blend = morph - frame;
+        const float *lower = base + frame * STRIDE + index;
+        const float *upper = lower + STRIDE;
+        float a = lower[0] + (lower[1] - lower[0]) * frac;
+        float b = upper[0] + (upper[1] - upper[0]) * frac;
+        return a + (b - a) * blend;
+    }
+    
+    float Wavetable::operator()(float phase, float param, size_t level) const
+    {
+        return lookup(table(level, 0), phase, param);
+    }
+    
+    void Wavetable::render(const float *phase, const float *param, float phaseDelta, float *out, size_t count) const
+    {
+        const float *base = table(level(phaseDelta), 0);
+        for (size_t i = 0; i < count; i++) {
+            out[i] = lookup(base, phase[i], param[i]);
+        }
+    }
+    
+}
\ No newline at end of file
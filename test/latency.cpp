@@ -0,0 +1,118 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "patchbank.hpp"
+#include "synthutil.hpp"
+
+/*
+ * Measures how long a live note takes from being pushed to reaching the
+ * first block that sounds it. A stand-in producer plays notes at random
+ * moments while the main thread renders blocks on a real-time schedule, as
+ * an audio callback would.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+const static int FIRST_NOTE = 36,
+    NOTE_RANGE = 48,
+    CHANNELS = 16;
+
+static void produce(Synth::EventQueue& queue, std::vector<Clock::time_point>& pushed, std::atomic<bool>& done,
+    int gapMsec)
+{
+    for (size_t i = 0; i < pushed.size(); i++) {
+        std::this_thread::sleep_for(std::chrono::microseconds(rand() % (gapMsec * 1000) + 500));
+        uint16_t channel = i % CHANNELS;
+        Synth::LiveEvent on {0, (uint16_t)(Midi::NOTE_ON | channel),
+            {(uint8_t)(FIRST_NOTE + i / CHANNELS % NOTE_RANGE), 100}};
+        pushed[i] = Clock::now();
+        while (!queue.push(on));
+        if (i >= CHANNELS) { // Release the note before last on this channel
+            Synth::LiveEvent off {0, (uint16_t)(Midi::NOTE_OFF | channel),
+                {(uint8_t)(FIRST_NOTE + (i / CHANNELS - 1) % NOTE_RANGE), 0}};
+            while (!queue.push(off));
+        }
+    }
+    done = true;
+}
+
+int main(int argc, char **argv)
+{
+    int params[] = {
+        48000, 128, 500, 10
+    };
+    for (int i = 0; i < 4 && i + 1 < argc; i++) {
+        params[i] = atoi(argv[i + 1]);
+    }
+    float samplerate = params[0];
+    size_t block = params[1];
+    size_t notes = std::min(params[2], CHANNELS * NOTE_RANGE);
+    Synth::SharedPatches patches;
+    try {
+        patches = Synth::PatchCache::load("patch.txt");
+    } catch (const char *error) {
+        std::cerr << "Error reading patches: " << error << "\n";
+    }
+    if (!patches || patches->empty()) {
+        patches = std::make_shared<const std::vector<Synth::Patch>>(1); // Silent, but the timing is the same
+    }
+    Synth::EventQueue queue;
+    Synth::Renderer renderer(queue, samplerate, *patches);
+    
+    std::vector<Clock::time_point> pushed(notes);
+    std::vector<bool> heard(notes, false);
+    std::vector<double> latency;
+    std::vector<float> out(block);
+    std::atomic<bool> done {false};
+    std::thread producer(produce, std::ref(queue), std::ref(pushed), std::ref(done), params[3]);
+    
+    auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(block / samplerate));
+    auto deadline = Clock::now();
+    size_t late = 0;
+    while (!done || queue.front()) {
+        renderer.render(out.data(), block);
+        auto now = Clock::now();
+        if (now > deadline + period) {
+            late++;
+        }
+        for (auto& voice : renderer.voices()) {
+            size_t id = (voice.getNote() - FIRST_NOTE) * CHANNELS + voice.getChannel();
+            if (id >= notes || heard[id]) {
+                continue;
+            }
+            heard[id] = true;
+            latency.push_back(std::chrono::duration<double, std::micro>(now - pushed[id]).count());
+        }
+        deadline += period;
+        std::this_thread::sleep_until(deadline);
+    }
+    producer.join();
+    
+    if (latency.empty()) {
+        std::cout << "No notes were heard in " << notes << " played\n";
+        return 1;
+    }
+    double mean = 0, spread = 0;
+    for (double l : latency) {
+        mean += l;
+    }
+    mean /= latency.size();
+    for (double l : latency) {
+        spread += (l - mean) * (l - mean);
+    }
+    spread = std::sqrt(spread / latency.size());
+    auto range = std::minmax_element(latency.begin(), latency.end());
+    std::cout << latency.size() << " notes, " << block << " frame blocks ("
+        << block / samplerate * Synth::SEC_TO_MSEC << " ms)\n"
+        << "Latency usec: min " << *range.first << ", mean " << mean << ", max " << *range.second << "\n"
+        << "Jitter usec: stddev " << spread << ", range " << *range.second - *range.first << "\n"
+        << "Late blocks: " << late << "\n";
+}
\ No newline at end of file
@@ -0,0 +1,73 @@
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include "synthutil.hpp"
+
+/*
+ * Checks that a note released off the control-block grid carries on from
+ * the phase it had reached, by rendering a sustained note a block at a time
+ * and comparing it with the per-sample Patch::operator() it approximates.
+ */
+
+const static float TOLERANCE = 0.01; // The block path ramps its modulators, so is never exact
+
+// Largest difference from the per-sample reference with the note released at sample release
+static float releaseError(const Synth::Patch& patch, float frequency, float samplerate, size_t controlBlock,
+    size_t release, size_t length)
+{
+    Synth::PatchState state {0, 0, 0, 0, true};
+    std::vector<float> reference(length);
+    for (size_t i = 0; i < length; i++) {
+        if (i == release) {
+            state.isActive = false;
+            state.eTime = 0;
+        }
+        patch(state, frequency, samplerate);
+        reference[i] = state.previous;
+    }
+
+    Synth::PlayingNote note(patch, frequency);
+    std::vector<float> rendered(length);
+    note.render(rendered.data(), release, samplerate, controlBlock, 0);
+    note.stop();
+    note.render(rendered.data() + release, length - release, samplerate, controlBlock, release);
+
+    float error = 0;
+    for (size_t i = 0; i < length; i++) {
+        error = std::max(error, std::fabs(rendered[i] - reference[i]));
+    }
+    return error;
+}
+
+int main(int argc, char **argv)
+{
+    int params[] = {
+        44100, 32, 20000
+    };
+    for (int i = 0; i < 3 && i + 1 < argc; i++) {
+        params[i] = atoi(argv[i + 1]);
+    }
+    float samplerate = params[0];
+    size_t block = params[1];
+    size_t release = params[2];
+    Synth::Patch patch({{
+        Synth::Synth::sinSaw,
+        {{{0.01, 1}, {0.2, 0}}, 0}, // Sustains, then fades once released
+        {{{0, 0.5}}}
+    }});
+
+    bool failed = false;
+    for (size_t offset = 0; offset < block; offset += std::max(size_t{1}, block / 8)) {
+        float error = releaseError(patch, 440, samplerate, block, release + offset, release + 2 * samplerate);
+        failed = failed || !(error < TOLERANCE);
+        std::cout << "Released " << offset << " samples into a block: max error " << error << "\n";
+    }
+    if (failed) {
+        std::cout << "Off-grid releases stray from the per-sample reference by over " << TOLERANCE << "\n";
+        return 1;
+    }
+    std::cout << "Releases match the per-sample reference\n";
+}
\ No newline at end of file
@@ -1,20 +1,29 @@
 #include <iostream>
 #include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <cmath>
 #include <fstream>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <ctime>
 
 #include "jpegutil.hpp"
 #include "aviutil.hpp"
+#include "kernels.hpp"
+#include "patchbank.hpp"
 #include "synthutil.hpp"
 
 #include <CL/cl.hpp>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define VIZ_X86
+#include <immintrin.h>
+#endif
+
 #define PARAMS_PER_BALL 6
 
 struct Ball {
@@ -53,13 +62,47 @@ struct Ball {
         
 };
 
-struct VideoState : Synth::Visualizer {
-    
-    int numFrames;
+// Balls placed at random, moving up to maxVel of the frame a second, with radii up to maxRad of its width
+static std::vector<Ball> makeBalls(size_t count, int width, int height, float fps, float maxVel, float maxRad)
+{
     std::vector<Ball> balls;
-    bool playingDrums;
+    for (size_t n = 0; n < count; n++) {
+        balls.push_back({(float)rand() / RAND_MAX * width, (float)rand() / RAND_MAX * height,
+            (float)rand() / RAND_MAX * width * maxVel / fps,
+            (float)rand() / RAND_MAX * height * maxVel / fps,
+            (float)rand() / RAND_MAX * width * maxRad,
+            (std::uint8_t)rand(), (std::uint8_t)rand(), (std::uint8_t)rand()});
+    }
+    return balls;
+}
 
-    cl::Platform platform;
+// Steps every ball a frame and packs them, PARAMS_PER_BALL floats each
+static void stepBalls(std::vector<Ball>& balls, std::vector<float>& ballBuf, int width, int height)
+{
+    ballBuf.resize(balls.size() * PARAMS_PER_BALL);
+    for (size_t i = 0; i < balls.size(); i++) {
+        Ball& ball = balls[i];
+        ball.step(width, height);
+        ballBuf[i * PARAMS_PER_BALL] = ball.x;
+        ballBuf[i * PARAMS_PER_BALL + 1] = ball.y;
+        ballBuf[i * PARAMS_PER_BALL + 2] = ball.rad;
+        ballBuf[i * PARAMS_PER_BALL + 3] = ball.r;
+        ballBuf[i * PARAMS_PER_BALL + 4] = ball.g;
+        ballBuf[i * PARAMS_PER_BALL + 5] = ball.b;
+    }
+}
+
+// Draws a frame of metaballs into width * height RGB pixels
+struct Metaballs {
+    virtual ~Metaballs() {}
+    virtual void render(const std::vector<float>& ballBuf, std::uint8_t *rgb) = 0;
+    virtual const char *name() const = 0;
+};
+
+struct ClMetaballs : Metaballs {
+    
+    int width, height;
+    size_t numBalls;
     cl::Device device;
     cl::Context context;
     cl::Program::Sources sources;
@@ -68,9 +111,238 @@ struct VideoState : Synth::Visualizer {
     cl::Kernel kernel;
     cl::Buffer input;
     cl::Buffer output;
+    std::string source;
+    
+    // Null if there is no OpenCL device to run on
+    static std::unique_ptr<Metaballs> create(int width, int height, size_t numBalls)
+    {
+        std::vector<cl::Platform> platforms;
+        cl::Platform::get(&platforms);
+        for (auto& platform : platforms) {
+            std::vector<cl::Device> devices;
+            platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+            if (!devices.empty()) {
+                std::unique_ptr<ClMetaballs> metaballs(new ClMetaballs(width, height, numBalls, devices[0]));
+                if (metaballs->build()) {
+                    return metaballs;
+                }
+            }
+        }
+        return nullptr;
+    }
+    
+    ClMetaballs(int width, int height, size_t numBalls, const cl::Device& device) :
+        width {width}, height {height}, numBalls {numBalls}, device {device} {}
+    
+    bool build()
+    {
+        context = {{device}};
+        source =
+            "void kernel metaballs(global const float *balldata, global uchar *rgb,\n"
+            "       uint numBalls, uint width, uint height){\n"
+            "   int id = get_global_id(0);\n"
+            "   float x = id % width;\n"
+            "   float y = id / width;\n"
+            "   float accum = 0.1;\n"
+            "   float r = 0, g = 0, b = 0;\n"
+            "   for (uint i = 0; i < numBalls; i++) {\n"
+            "       float mag = balldata[i * 6 + 2] / max(1.0f, \n"
+            "           hypot(x - balldata[i * 6], y - balldata[i * 6 + 1]));\n"
+            "       accum += mag;\n"
+            "       r += balldata[i * 6 + 3] * mag;\n"
+            "       g += balldata[i * 6 + 4] * mag;\n"
+            "       b += balldata[i * 6 + 5] * mag;\n"
+            "   }\n"
+            "   rgb[id * 3] = (accum >= 1) ? (r / accum) : (x * 255 / width);\n"
+            "   rgb[id * 3 + 1] = (accum >= 1) ? (g / accum) : (y * 255 / height);\n"
+            "   rgb[id * 3 + 2] = accum >= 1.0 ? (b / accum) : 0;\n"
+            "}\n";
+        sources.push_back({source.c_str(), source.length()});
+        program = {context, sources};
+        if (program.build({device}) != CL_SUCCESS) {
+            std::cerr << "Error building program: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
+            return false;
+        }
+        q = {context, device};
+        kernel = {program, "metaballs"};
+        input = {context, CL_MEM_READ_ONLY, sizeof(cl_float) * numBalls * PARAMS_PER_BALL};
+        output = {context, CL_MEM_READ_WRITE, size_t{3} * width * height};
+        return true;
+    }
+    
+    virtual void render(const std::vector<float>& ballBuf, std::uint8_t *rgb)
+    {
+        q.enqueueWriteBuffer(input, CL_TRUE, 0, sizeof(cl_float) * numBalls * PARAMS_PER_BALL, ballBuf.data());
+        kernel.setArg(0, input);
+        kernel.setArg(1, output);
+        kernel.setArg(2, (cl_uint)numBalls);
+        kernel.setArg(3, (cl_uint)width);
+        kernel.setArg(4, (cl_uint)height);
+        q.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(width * height), cl::NullRange);
+        q.finish();
+        q.enqueueReadBuffer(output, CL_TRUE, 0, width * height * 3, rgb);
+    }
+    
+    virtual const char *name() const
+    {
+        return "OpenCL";
+    }
+};
+
+// Adds one ball's field across a row, from pixel first on, and returns the pixel it stopped at
+typedef int (*FieldKernel)(const float *ball, float dy, float *accum, float *r, float *g, float *b, int first, int width);
+
+static int addFieldScalar(const float *ball, float dy, float *accum, float *r, float *g, float *b, int first, int width)
+{
+    for (int x = first; x < width; x++) {
+        float dx = x - ball[0];
+        float mag = ball[2] / std::max(1.0f, std::sqrt(dx * dx + dy * dy));
+        accum[x] += mag;
+        r[x] += ball[3] * mag;
+        g[x] += ball[4] * mag;
+        b[x] += ball[5] * mag;
+    }
+    return width;
+}
+
+#ifdef VIZ_X86
+
+// Rounds as the scalar loop does, so every path draws the same pixels
+__attribute__((target("sse2")))
+static int addFieldSse2(const float *ball, float dy, float *accum, float *r, float *g, float *b, int first, int width)
+{
+    __m128 bx = _mm_set1_ps(ball[0]), rad = _mm_set1_ps(ball[2]), one = _mm_set1_ps(1.0f);
+    __m128 dy2 = _mm_set1_ps(dy * dy), lanes = _mm_setr_ps(0, 1, 2, 3);
+    __m128 br = _mm_set1_ps(ball[3]), bg = _mm_set1_ps(ball[4]), bb = _mm_set1_ps(ball[5]);
+    int x = first;
+    for (; x + 4 <= width; x += 4) {
+        __m128 dx = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(x), lanes), bx);
+        __m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), dy2));
+        __m128 mag = _mm_div_ps(rad, _mm_max_ps(one, distance));
+        _mm_storeu_ps(accum + x, _mm_add_ps(_mm_loadu_ps(accum + x), mag));
+        _mm_storeu_ps(r + x, _mm_add_ps(_mm_loadu_ps(r + x), _mm_mul_ps(br, mag)));
+        _mm_storeu_ps(g + x, _mm_add_ps(_mm_loadu_ps(g + x), _mm_mul_ps(bg, mag)));
+        _mm_storeu_ps(b + x, _mm_add_ps(_mm_loadu_ps(b + x), _mm_mul_ps(bb, mag)));
+    }
+    return x;
+}
+
+// Built without FMA, which would round differently
+__attribute__((target("avx2")))
+static int addFieldAvx2(const float *ball, float dy, float *accum, float *r, float *g, float *b, int first, int width)
+{
+    __m256 bx = _mm256_set1_ps(ball[0]), rad = _mm256_set1_ps(ball[2]), one = _mm256_set1_ps(1.0f);
+    __m256 dy2 = _mm256_set1_ps(dy * dy), lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 br = _mm256_set1_ps(ball[3]), bg = _mm256_set1_ps(ball[4]), bb = _mm256_set1_ps(ball[5]);
+    int x = first;
+    for (; x + 8 <= width; x += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_add_ps(_mm256_set1_ps(x), lanes), bx);
+        __m256 distance = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), dy2));
+        __m256 mag = _mm256_div_ps(rad, _mm256_max_ps(one, distance));
+        _mm256_storeu_ps(accum + x, _mm256_add_ps(_mm256_loadu_ps(accum + x), mag));
+        _mm256_storeu_ps(r + x, _mm256_add_ps(_mm256_loadu_ps(r + x), _mm256_mul_ps(br, mag)));
+        _mm256_storeu_ps(g + x, _mm256_add_ps(_mm256_loadu_ps(g + x), _mm256_mul_ps(bg, mag)));
+        _mm256_storeu_ps(b + x, _mm256_add_ps(_mm256_loadu_ps(b + x), _mm256_mul_ps(bb, mag)));
+    }
+    return x;
+}
+
+#endif
+
+// The widest field kernel the synth's own kernels are using
+static FieldKernel fieldKernel()
+{
+#ifdef VIZ_X86
+    if (Synth::Kernels::isa() == Synth::Kernels::AVX2) {
+        return addFieldAvx2;
+    }
+    if (Synth::Kernels::isa() == Synth::Kernels::SSE2) {
+        return addFieldSse2;
+    }
+#endif
+    return nullptr;
+}
+
+/*
+ * The OpenCL kernel on the CPU. Threads take bands of rows in turn, and each
+ * row sums the field one ball at a time across all its pixels, a vector of
+ * pixels per step.
+ */
+struct CpuMetaballs : Metaballs {
+    
+    const static int BAND_ROWS = 8;
+    
+    int width, height;
+    Synth::RenderPool pool;
+    std::vector<float> scratch; // Per thread, a row each of accum, r, g and b
+    FieldKernel kernel; // Null for the scalar loop alone
+    
+    CpuMetaballs(int width, int height, size_t threads = 0) :
+        width {width}, height {height}, pool (threads), scratch (pool.size() * 4 * width), kernel {fieldKernel()} {}
+    
+    void renderRow(const std::vector<float>& ballBuf, int y, float *__restrict accum, float *__restrict r,
+        float *__restrict g, float *__restrict b, std::uint8_t *__restrict rgb)
+    {
+        std::fill(accum, accum + width, 0.1f);
+        std::fill(r, r + width, 0.0f);
+        std::fill(g, g + width, 0.0f);
+        std::fill(b, b + width, 0.0f);
+        for (size_t i = 0; i < ballBuf.size(); i += PARAMS_PER_BALL) {
+            const float *ball = ballBuf.data() + i;
+            float dy = y - ball[1];
+            int x = kernel ? kernel(ball, dy, accum, r, g, b, 0, width) : 0;
+            addFieldScalar(ball, dy, accum, r, g, b, x, width);
+        }
+        for (int x = 0; x < width; x++) {
+            bool inside = accum[x] >= 1;
+            rgb[x * 3] = inside ? r[x] / accum[x] : (float)x * 255 / width;
+            rgb[x * 3 + 1] = inside ? g[x] / accum[x] : (float)y * 255 / height;
+            rgb[x * 3 + 2] = inside ? b[x] / accum[x] : 0;
+        }
+    }
+    
+    virtual void render(const std::vector<float>& ballBuf, std::uint8_t *rgb)
+    {
+        pool.run([&](size_t worker) {
+            float *rows = scratch.data() + worker * 4 * width;
+            for (int band = worker * BAND_ROWS; band < height; band += pool.size() * BAND_ROWS) {
+                for (int y = band; y < std::min(height, band + BAND_ROWS); y++) {
+                    renderRow(ballBuf, y, rows, rows + width, rows + 2 * width, rows + 3 * width,
+                        rgb + (size_t)y * width * 3);
+                }
+            }
+        });
+    }
+    
+    virtual const char *name() const
+    {
+        return "CPU";
+    }
+};
+
+// The OpenCL renderer unless there is none or cpu is set
+static std::unique_ptr<Metaballs> makeMetaballs(int width, int height, size_t numBalls, bool cpu)
+{
+    std::unique_ptr<Metaballs> metaballs;
+    if (!cpu) {
+        metaballs = ClMetaballs::create(width, height, numBalls);
+    }
+    if (!metaballs) {
+        metaballs.reset(new CpuMetaballs(width, height));
+    }
+    return metaballs;
+}
+
+struct VideoState : Synth::Visualizer {
+    
+    std::vector<Ball> balls;
+    bool playingDrums;
+
+    std::vector<float> ballBuf;
+    std::unique_ptr<Metaballs> metaballs;
     
     Jpeg::JpegSettings subjpegsettings;
-    Jpeg::Jpeg subimg;
+    std::vector<std::unique_ptr<Jpeg::Jpeg>> subimgs; // One per encoder thread
     
     VideoState(
             float samplerate,
@@ -81,70 +353,45 @@ struct VideoState : Synth::Visualizer {
             std::ostream& stream,
             int jpegQuality = 90,
             float maxVel = 1.0f / 3,
-            float maxRad = 1.0f / 10) :
-        Visualizer (samplerate, fps, width, height, bps, stream, jpegQuality),
+            float maxRad = 1.0f / 10,
+            size_t encoders = 1,
+            size_t inFlight = QUEUED_OUTPUTS,
+            bool cpu = false) :
+        Visualizer (samplerate, fps, width, height, bps, stream, jpegQuality, inFlight, encoders),
         subjpegsettings (std::pair<int, int>(width, height), nullptr, Jpeg::DPI, {1, 1}, jpegQuality),
-        subimg (subjpegsettings),
-        numFrames {0},
         playingDrums {false} {
-            for (size_t n = 0; n < 5; n++) {
-                balls.push_back({(float)rand() / RAND_MAX * width, (float)rand() / RAND_MAX * height,
-                    (float)rand() / RAND_MAX * width * maxVel / fps,
-                    (float)rand() / RAND_MAX * height * maxVel / fps,
-                    (float)rand() / RAND_MAX * width * maxRad,
-                    (std::uint8_t)rand(), (std::uint8_t)rand(), (std::uint8_t)rand()});
+            for (size_t i = 0; i < encoderCount(); i++) {
+                subimgs.emplace_back(new Jpeg::Jpeg(subjpegsettings));
             }
-            std::vector<cl::Platform> platforms;
-            cl::Platform::get(&platforms);
-            platform = platforms[0];
-            std::vector<cl::Device> devices;
-            platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
-            device = devices[0];
-            context = {{device}};
-            std::string source = 
-                "void kernel metaballs(global const float *balldata, global uchar *rgb,\n"
-                "       uint numBalls, uint width, uint height){\n"
-                "   int id = get_global_id(0);\n"
-                "   float x = id % width;\n"
-                "   float y = id / width;\n"
-                "   float accum = 0.1;\n"
-                "   float r = 0, g = 0, b = 0;\n"
-                "   for (uint i = 0; i < numBalls; i++) {\n"
-                "       float mag = balldata[i * 6 + 2] / max(1.0f, \n"
-                "           hypot(x - balldata[i * 6], y - balldata[i * 6 + 1]));\n"
-                "       accum += mag;\n"
-                "       r += balldata[i * 6 + 3] * mag;\n"
-                "       g += balldata[i * 6 + 4] * mag;\n"
-                "       b += balldata[i * 6 + 5] * mag;\n"
-                "   }\n"
-                "   rgb[id * 3] = (accum >= 1) ? (r / accum) : (x * 255 / width);\n"
-                "   rgb[id * 3 + 1] = (accum >= 1) ? (g / accum) : (y * 255 / height);\n"
-                "   rgb[id * 3 + 2] = accum >= 1.0 ? (b / accum) : 0;\n"
-                "}\n";
-            std::cout << source;
-            sources.push_back({source.c_str(), source.length()});
-            program = {context, sources};
-            if (program.build({device}) != CL_SUCCESS) {
-                std::cerr << "Error building program: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
-            }
-            q = {context, device};
-            kernel = {program, "metaballs"};
-            input = {context, CL_MEM_READ_ONLY, sizeof(cl_float) * balls.size() * PARAMS_PER_BALL};
-            output = {context, CL_MEM_READ_WRITE, size_t{3} * width * height};
+            balls = makeBalls(5, width, height, fps, maxVel, maxRad);
+            metaballs = makeMetaballs(width, height, balls.size(), cpu);
+            std::cerr << "Rendering frames with " << metaballs->name() << "\n";
         }
     
-    virtual ~VideoState() {}
+    virtual ~VideoState()
+    {
+        stop(); // Before subimgs go, which encodeFrame uses
+    }
+    
+    // Keeps a JPEG of every frame alongside the AVI, frames encoding side by side. The AVI's
+    // MJPEG frames are encoded on the writer thread regardless, one at a time.
+    virtual void encodeFrame(const std::vector<std::uint8_t>& rgb, int frame, size_t encoder)
+    {
+        Jpeg::Jpeg& subimg = *subimgs[encoder];
+        subimg.encodeRGB(rgb.data());
+        std::ofstream out(std::string("frames/frame") + std::to_string(frame) + ".jpg", std::ios_base::out | std::ios_base::binary);
+        subimg.write(out);
+        out.close();
+        std::cout << ('#' + std::to_string(frame) + " written\n");
+    }
     
-    virtual void callback(const std::vector<float>& samples,
-        const std::map<std::pair<int, int>, Synth::PlayingNote>& notes)
+    virtual void callback(const std::vector<float>& samples, const Synth::VoicePool& notes)
     {
         size_t samplesPerFrame = (samplerate + framerate - 1) / framerate;
-        for (auto it : samples) {
-            buffer.push_back(it * sampleNorm);
-        }
+        queueSamples(samples);
         bool curDrums = false;
-        for (auto it : notes) {
-            if (it.first.first == 9) {
+        for (auto& note : notes) {
+            if (note.getChannel() == 9) {
                 if (!playingDrums) {
                     float x = (float)rand() / RAND_MAX * width;
                     float y = (float)rand() / RAND_MAX * height;
@@ -158,70 +405,102 @@ struct VideoState : Synth::Visualizer {
             }
         }
         playingDrums = curDrums;
-        size_t startId = 0;
-        for (; startId + samplesPerFrame <= buffer.size(); startId += samplesPerFrame) {
-            cl_float ballBuf[balls.size() * 3];
-            for (size_t i = 0; i < balls.size(); i++) {
-                Ball& ball = balls[i];
-                ball.step(width, height);
-                ballBuf[i * PARAMS_PER_BALL] = ball.x;
-                ballBuf[i * PARAMS_PER_BALL + 1] = ball.y;
-                ballBuf[i * PARAMS_PER_BALL + 2] = ball.rad;
-                ballBuf[i * PARAMS_PER_BALL + 3] = ball.r;
-                ballBuf[i * PARAMS_PER_BALL + 4] = ball.g;
-                ballBuf[i * PARAMS_PER_BALL + 5] = ball.b;
-            }
-            std::fill(rgb.begin(), rgb.end(), 254);
-            // for (int i = 0; i < width * height; i++) {
-                // rgb[i * 3] = i & 255;
-                // rgb[i * 3 + 1] = (i / 5) & 255;
-                // rgb[i * 3 + 2] = (i / 11) & 255;
-            // }
-            q.enqueueWriteBuffer(input, CL_TRUE, 0, sizeof(cl_float) * balls.size() * PARAMS_PER_BALL, ballBuf);
-            kernel.setArg(0, input);
-            kernel.setArg(1, output);
-            kernel.setArg(2, (cl_uint)balls.size());
-            kernel.setArg(3, (cl_uint)width);
-            kernel.setArg(4, (cl_uint)height);
-            q.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(width * height), cl::NullRange);
-            q.finish();
-            q.enqueueReadBuffer(output, CL_TRUE, 0, width * height * 3, rgb.data());
-            fmavi.writeVideoFrame(out, rgb.data());
-            std::cout << '#' << (numFrames) << " writing\n";
-            subimg.encodeRGB(rgb.data());
-            std::ofstream out(std::string("frames/frame") + std::to_string(numFrames) + ".jpg", std::ios_base::out | std::ios_base::binary);
-            subimg.write(out);
-            std::cout << '#' << (numFrames++) << " written\n";
-            out.close();
+        size_t frames = buffer.size() / samplesPerFrame;
+        for (size_t frame = 0; frame < frames; frame++) {
+            stepBalls(balls, ballBuf, width, height);
+            metaballs->render(ballBuf, nextFrame().data());
+            writeFrame();
         }
-        fmavi.writeSamples(out, std::vector<int32_t>(buffer.begin(), buffer.begin() + startId));
-        buffer.erase(buffer.begin(), buffer.begin() + startId);
+        writeSamples(frames * samplesPerFrame);
     }
    
 };
 
+const static int BENCH_FRAMES = 30;
+
+static double framesPerSecond(Metaballs& metaballs, int width, int height)
+{
+    std::vector<Ball> balls = makeBalls(5, width, height, 12, 1.0f / 3, 1.0f / 20);
+    std::vector<float> ballBuf;
+    std::vector<std::uint8_t> rgb(size_t{3} * width * height);
+    stepBalls(balls, ballBuf, width, height);
+    metaballs.render(ballBuf, rgb.data()); // Warms up threads and caches
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < BENCH_FRAMES; frame++) {
+        stepBalls(balls, ballBuf, width, height);
+        metaballs.render(ballBuf, rgb.data());
+    }
+    return BENCH_FRAMES / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Frame rates of each metaballs renderer at common video sizes
+static int benchmark(bool cpu)
+{
+    const int sizes[][2] = {{1280, 720}, {1920, 1080}, {3840, 2160}};
+    for (auto& size : sizes) {
+        std::cout << size[1] << "p:";
+        CpuMetaballs onCpu(size[0], size[1]);
+        std::cout << " CPU " << framesPerSecond(onCpu, size[0], size[1]) << " fps";
+        std::unique_ptr<Metaballs> onCl = cpu ? nullptr : ClMetaballs::create(size[0], size[1], 5);
+        if (onCl) {
+            std::cout << ", OpenCL " << framesPerSecond(*onCl, size[0], size[1]) << " fps\n";
+        }
+        else {
+            std::cout << ", OpenCL unavailable\n";
+        }
+    }
+    return 0;
+}
+
 int main(int argc, char**argv)
 {
     srand(time(NULL));
+    // --cpu renders frames without OpenCL, --bench only times the renderers
+    bool cpu = false, bench = false;
+    std::vector<const char*> args;
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--cpu") {
+            cpu = true;
+        }
+        else if (std::string(argv[i]) == "--bench") {
+            bench = true;
+        }
+        else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (bench) {
+        return benchmark(cpu);
+    }
     std::ifstream stream("../../../Python/SpeechProjects/Formants/midi.mid", std::ios::binary);
-    std::ifstream pstream("patch.txt");
     std::ofstream out("out.avi", std::ios::binary);
     if (!stream.is_open()) {
         std::cerr << "Couldn't open\n";
     }
-    std::vector<Synth::Patch> patches = Synth::readPatches(pstream);
-    std::cerr << patches[0];
+    Synth::SharedPatches patches;
+    try {
+        patches = Synth::PatchCache::load("patch.txt");
+    } catch (const char *error) {
+        std::cerr << "Error reading patches: " << error << "\n";
+    }
+    if (!patches || patches->empty()) {
+        return 1;
+    }
+    std::cerr << (*patches)[0];
+    // FPS, width, height, bits per sample, JPEG quality, still-frame JPEG encoders (0 for one per core), frames in flight
     int params[] = {
-        12, 1920, 1080, 16, 100
+        12, 1920, 1080, 16, 100, 0, 0
     };
-    for (int i = 0; i < 5 && i + 1 < argc; i++) {
-        params[i] = atoi(argv[i + 1]);
+    for (size_t i = 0; i < 7 && i < args.size(); i++) {
+        params[i] = atoi(args[i]);
     }
-    static VideoState vs (44100, params[0], params[1], params[2], params[3], out, params[4], 1.0f / 3, 1.0f / 20);
+    size_t encoders = params[5] > 0 ? params[5] : std::max(1u, std::thread::hardware_concurrency());
+    size_t inFlight = params[6] > 0 ? params[6] : 2 * encoders + 2; // Enough to keep every encoder busy
+    static VideoState vs (44100, params[0], params[1], params[2], params[3], out, params[4], 1.0f / 3, 1.0f / 20,
+        encoders, inFlight, cpu);
     // auto callback = [](const std::vector<float>& samples) mutable {vs.callback(samples);};
-    Synth::play(stream, 44100, Synth::Visualizer::play, patches, static_cast<void*>(&vs));
+    Synth::play(stream, 44100, Synth::Visualizer::play, *patches, static_cast<void*>(&vs));
     vs.finish();
     stream.close();
-    pstream.close();
     out.close();
 }
\ No newline at end of file